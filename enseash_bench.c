@@ -0,0 +1,417 @@
+// enseash_bench.c - replay a corpus of command lines against an enseash binary
+//
+// Measures how much time the shell itself spends per command, so revisions
+// (enseash_q2.c ... enseash_q7.c) and changes to parse_args,
+// setup_redirections or the launch path can be compared.
+//
+//   ./enseash_bench BINARY CORPUS [-r ROUNDS] [--pipe] [--cold]
+//
+// Default (lockstep): each line is sent only after the previous prompt was
+// seen. Every revision supports this, since the early ones do a single
+// read() per prompt. The time from a line to the next prompt is its latency.
+//
+// --pipe: the whole corpus is streamed at once, which measures throughput.
+// Only revisions that buffer their input (enseash_q7.c) keep up with it.
+//
+// If the binary supports ENSEASH_PHASES (enseash_q7.c), its per-phase totals
+// are shown too: prompt, input, parse, fork, exec, wait (the command itself)
+// and other (history and stats bookkeeping).
+//
+// --cold: drop the page cache before starting the shell (needs root), to
+// measure cold launches, e.g. with and without ENSEASH_PREFETCH=1.
+
+#include <unistd.h>     // read, write, fork, execv, pipe, dup2
+#include <string.h>     // strlen, memcpy, strcmp, strncmp
+#include <stdlib.h>     // malloc, qsort, setenv, EXIT_FAILURE
+#include <sys/types.h>  // pid_t
+#include <sys/wait.h>   // waitpid
+#include <time.h>       // clock_gettime
+#include <errno.h>
+#include <fcntl.h>      // open
+#include <poll.h>       // poll
+#include <signal.h>     // signal, SIGPIPE
+
+#define LINE_SIZE    256
+#define MAX_LINES    4096
+#define OUT_SIZE     512
+#define CHUNK        65536
+#define PHASE_COUNT  7
+
+static const char *phase_names[PHASE_COUNT] = {
+    "prompt", "input", "parse", "fork", "exec", "wait", "other"
+};
+
+static char corpus[MAX_LINES][LINE_SIZE];
+static int n_lines;
+
+static void safe_write(int fd, const char *str)
+{
+    (void)write(fd, str, strlen(str));
+}
+
+static void append_str(char *dst, size_t *pos, size_t max, const char *src)
+{
+    while (*src && *pos + 1 < max) dst[(*pos)++] = *src++;
+    dst[*pos] = '\0';
+}
+
+static void append_num(char *dst, size_t *pos, size_t max, unsigned long long v)
+{
+    char tmp[32];
+    int i = 0;
+
+    if (v == 0) tmp[i++] = '0';
+    while (v > 0) { tmp[i++] = (char)('0' + (v % 10)); v /= 10; }
+    while (i-- > 0 && *pos + 1 < max) dst[(*pos)++] = tmp[i];
+    dst[*pos] = '\0';
+}
+
+// "12.345" from thousandths.
+static void append_milli(char *dst, size_t *pos, size_t max, unsigned long long v)
+{
+    unsigned long long frac = v % 1000;
+
+    append_num(dst, pos, max, v / 1000);
+    append_str(dst, pos, max, ".");
+    if (frac < 100) append_str(dst, pos, max, "0");
+    if (frac < 10) append_str(dst, pos, max, "0");
+    append_num(dst, pos, max, frac);
+}
+
+static void append_pad(char *dst, size_t *pos, size_t max, size_t col)
+{
+    do {
+        append_str(dst, pos, max, " ");
+    } while (*pos < col && *pos + 1 < max);
+}
+
+static unsigned long long elapsed_ns(struct timespec a, struct timespec b)
+{
+    return (unsigned long long)(b.tv_sec - a.tv_sec) * 1000000000ULL
+         + (unsigned long long)b.tv_nsec - (unsigned long long)a.tv_nsec;
+}
+
+static unsigned long long parse_num(const char *s)
+{
+    unsigned long long v = 0;
+    for (; *s >= '0' && *s <= '9'; s++) v = v * 10 + (unsigned long long)(*s - '0');
+    return v;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+// One command per line; empty lines and lines starting with '#' are skipped.
+static int load_corpus(const char *file)
+{
+    static char buf[MAX_LINES * LINE_SIZE];
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return -1;
+
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) len += (size_t)n;
+    close(fd);
+    buf[len] = '\0';
+
+    for (char *p = buf; *p != '\0' && n_lines < MAX_LINES; ) {
+        char *end = p;
+        while (*end != '\0' && *end != '\n') end++;
+        size_t l = (size_t)(end - p);
+
+        if (l > 0 && p[0] != '#' && l < LINE_SIZE) {
+            memcpy(corpus[n_lines], p, l);
+            corpus[n_lines][l] = '\0';
+            n_lines++;
+        }
+        p = (*end == '\n') ? end + 1 : end;
+    }
+    return n_lines > 0 ? 0 : -1;
+}
+
+static pid_t spawn(const char *binary, int *to_shell, int *from_shell)
+{
+    int in[2], out[2];
+
+    if (pipe(in) < 0 || pipe(out) < 0) return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        if (null >= 0) dup2(null, STDERR_FILENO);
+        close(in[0]); close(in[1]);
+        close(out[0]); close(out[1]);
+        char *argv[] = { (char *)binary, NULL };
+        execv(binary, argv);
+        _exit(127);
+    }
+
+    close(in[0]);
+    close(out[1]);
+    *to_shell = in[1];
+    *from_shell = out[0];
+    return pid;
+}
+
+// Consume shell output and count the prompts in it (each ends with "% ").
+// Returns the number of prompts seen, or -1 on EOF.
+static int read_prompts(int fd, char *tail)
+{
+    static char chunk[CHUNK];
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    int prompts = 0;
+
+    if (n <= 0) return -1;
+    for (ssize_t i = 0; i < n; i++) {
+        tail[0] = tail[1];
+        tail[1] = chunk[i];
+        if (tail[0] == '%' && tail[1] == ' ') prompts++;
+    }
+    return prompts;
+}
+
+static int wait_prompt(int fd, char *tail)
+{
+    for (;;) {
+        int p = read_prompts(fd, tail);
+        if (p < 0) return -1;
+        if (p > 0) return 0;
+    }
+}
+
+// prefetch[] = requests, files, bytes, ns (ENSEASH_PREFETCH=1).
+static void load_phases(const char *file, unsigned long long *cmds, unsigned long long *ns,
+                        unsigned long long *prefetch)
+{
+    char buf[1024];
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return;
+    buf[n] = '\0';
+
+    for (char *p = buf; *p != '\0'; ) {
+        if (strncmp(p, "commands ", 9) == 0) *cmds = parse_num(p + 9);
+        if (strncmp(p, "prefetch ", 9) == 0) {
+            char *q = p + 9;
+            for (int i = 0; i < 4; i++) {
+                prefetch[i] = parse_num(q);
+                while (*q >= '0' && *q <= '9') q++;
+                if (*q == ' ') q++;
+            }
+        }
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            size_t l = strlen(phase_names[i]);
+            if (strncmp(p, phase_names[i], l) == 0 && p[l] == ' ') ns[i] = parse_num(p + l + 1);
+        }
+        while (*p != '\0' && *p != '\n') p++;
+        if (*p == '\n') p++;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int rounds = 10;
+    int pipe_mode = 0;
+    int cold = 0;
+
+    if (argc < 3) {
+        safe_write(STDERR_FILENO, "Usage: enseash_bench BINARY CORPUS [-r ROUNDS] [--pipe] [--cold]\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--pipe") == 0) pipe_mode = 1;
+        else if (strcmp(argv[i], "--cold") == 0) cold = 1;
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) rounds = (int)parse_num(argv[++i]);
+    }
+    if (rounds < 1) rounds = 1;
+    if (load_corpus(argv[2]) < 0) {
+        safe_write(STDERR_FILENO, "Error: cannot read corpus\n");
+        return EXIT_FAILURE;
+    }
+
+    // keep the shell's side files out of the user's home
+    char phases_file[64], hist_file[64];
+    size_t pos = 0;
+    phases_file[0] = hist_file[0] = '\0';
+    append_str(phases_file, &pos, sizeof(phases_file), "/tmp/enseash_bench_phases.");
+    append_num(phases_file, &pos, sizeof(phases_file), (unsigned long long)getpid());
+    pos = 0;
+    append_str(hist_file, &pos, sizeof(hist_file), "/tmp/enseash_bench_hist.");
+    append_num(hist_file, &pos, sizeof(hist_file), (unsigned long long)getpid());
+    unlink(phases_file);
+    setenv("ENSEASH_PHASES", phases_file, 1);
+    setenv("ENSEASH_HISTFILE", hist_file, 1);
+
+    signal(SIGPIPE, SIG_IGN);   // early revisions may exit while we write
+
+    int total = n_lines * rounds;
+    unsigned long long *lat = malloc((size_t)total * sizeof(*lat));
+    if (lat == NULL) return EXIT_FAILURE;
+
+    if (cold) {
+        int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+        sync();
+        if (fd < 0 || write(fd, "3\n", 2) != 2) {
+            safe_write(STDERR_FILENO, "Error: cannot drop the page cache (root needed)\n");
+            return EXIT_FAILURE;
+        }
+        close(fd);
+    }
+
+    int to_shell, from_shell;
+    char tail[2] = { 0, 0 };
+    pid_t pid = spawn(argv[1], &to_shell, &from_shell);
+    if (pid < 0) return EXIT_FAILURE;
+
+    struct timespec t0, t1;
+    int done = 0;
+
+    if (wait_prompt(from_shell, tail) < 0) {
+        safe_write(STDERR_FILENO, "Error: the shell exited before its first prompt\n");
+    } else if (!pipe_mode) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (; done < total; done++) {
+            char line[LINE_SIZE + 1];
+            size_t l = strlen(corpus[done % n_lines]);
+            memcpy(line, corpus[done % n_lines], l);
+            line[l] = '\n';
+
+            struct timespec a, b;
+            clock_gettime(CLOCK_MONOTONIC, &a);
+            if (write(to_shell, line, l + 1) != (ssize_t)(l + 1)) break;
+            if (wait_prompt(from_shell, tail) < 0) break;
+            clock_gettime(CLOCK_MONOTONIC, &b);
+            lat[done] = elapsed_ns(a, b);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    } else {
+        // stream stdin while draining stdout, or both pipes would fill up
+        int sent = 0;
+        size_t off = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        while (done < total) {
+            struct pollfd pfds[2];
+            pfds[0].fd = from_shell;
+            pfds[0].events = POLLIN;
+            pfds[1].fd = sent < total ? to_shell : -1;
+            pfds[1].events = POLLOUT;
+            if (poll(pfds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (pfds[1].revents & POLLOUT) {
+                const char *line = corpus[sent % n_lines];
+                size_t l = strlen(line);
+                if (off < l) {
+                    ssize_t w = write(to_shell, line + off, l - off);
+                    if (w > 0) off += (size_t)w;
+                }
+                if (off == l && write(to_shell, "\n", 1) == 1) {
+                    off = 0;
+                    sent++;
+                }
+            }
+            if (pfds[0].revents & (POLLIN | POLLHUP)) {
+                int p = read_prompts(from_shell, tail);
+                if (p < 0) break;
+                done += p;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    }
+
+    (void)write(to_shell, "exit\n", 5);
+    close(to_shell);
+    while (read_prompts(from_shell, tail) >= 0) { }
+    close(from_shell);
+    waitpid(pid, NULL, 0);
+    unlink(hist_file);
+
+    // report
+    char out[OUT_SIZE];
+    unsigned long long wall = elapsed_ns(t0, t1);
+
+    pos = 0;
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), argv[1]);
+    append_str(out, &pos, sizeof(out), pipe_mode ? " (pipe)" : " (lockstep)");
+    if (cold) append_str(out, &pos, sizeof(out), " cold");
+    append_str(out, &pos, sizeof(out), "\ncommands: ");
+    append_num(out, &pos, sizeof(out), (unsigned long long)done);
+    if (done < total) {
+        append_str(out, &pos, sizeof(out), " of ");
+        append_num(out, &pos, sizeof(out), (unsigned long long)total);
+        append_str(out, &pos, sizeof(out), " (the shell stopped early)");
+    }
+    append_str(out, &pos, sizeof(out), "\nthroughput: ");
+    append_num(out, &pos, sizeof(out), wall ? (unsigned long long)done * 1000000000ULL / wall : 0);
+    append_str(out, &pos, sizeof(out), " commands/s\n");
+    if (!pipe_mode && done > 0) {
+        qsort(lat, (size_t)done, sizeof(*lat), cmp_ull);
+        append_str(out, &pos, sizeof(out), "latency (ms): p50 ");
+        append_milli(out, &pos, sizeof(out), lat[done * 50 / 100] / 1000);
+        append_str(out, &pos, sizeof(out), "  p90 ");
+        append_milli(out, &pos, sizeof(out), lat[done * 90 / 100] / 1000);
+        append_str(out, &pos, sizeof(out), "  p99 ");
+        append_milli(out, &pos, sizeof(out), lat[done * 99 / 100] / 1000);
+        append_str(out, &pos, sizeof(out), "\n");
+    }
+    safe_write(STDOUT_FILENO, out);
+
+    unsigned long long cmds = 0, ns[PHASE_COUNT] = { 0 }, prefetch[4] = { 0 };
+    load_phases(phases_file, &cmds, ns, prefetch);
+    unlink(phases_file);
+    if (cmds == 0) {
+        safe_write(STDOUT_FILENO, "phases: not reported by this binary\n\n");
+        free(lat);
+        return 0;
+    }
+
+    unsigned long long sum = 0, overhead = 0;
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        sum += ns[i];
+        if (i != 5) overhead += ns[i];   // everything but "wait" is the shell's own time
+    }
+
+    safe_write(STDOUT_FILENO, "phase     us/command  share\n");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        pos = 0;
+        out[0] = '\0';
+        append_str(out, &pos, sizeof(out), phase_names[i]);
+        append_pad(out, &pos, sizeof(out), 10);
+        append_milli(out, &pos, sizeof(out), ns[i] / cmds);
+        append_pad(out, &pos, sizeof(out), 22);
+        append_num(out, &pos, sizeof(out), sum ? ns[i] * 100 / sum : 0);
+        append_str(out, &pos, sizeof(out), "%\n");
+        safe_write(STDOUT_FILENO, out);
+    }
+    pos = 0;
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "shell overhead (all but wait): ");
+    append_milli(out, &pos, sizeof(out), overhead / cmds);
+    append_str(out, &pos, sizeof(out), " us/command\n");
+    if (prefetch[0] > 0) {
+        append_str(out, &pos, sizeof(out), "prefetch: ");
+        append_num(out, &pos, sizeof(out), prefetch[0]);
+        append_str(out, &pos, sizeof(out), " requests, ");
+        append_num(out, &pos, sizeof(out), prefetch[1]);
+        append_str(out, &pos, sizeof(out), " files, ");
+        append_num(out, &pos, sizeof(out), prefetch[2] >> 20);
+        append_str(out, &pos, sizeof(out), " MB, ");
+        append_milli(out, &pos, sizeof(out), prefetch[3] / 1000);
+        append_str(out, &pos, sizeof(out), " ms in the worker\n");
+    }
+    append_str(out, &pos, sizeof(out), "\n");
+    safe_write(STDOUT_FILENO, out);
+
+    free(lat);
+    return 0;
+}
@@ -0,0 +1,276 @@
+// enseash_load.c - load-test client for "enseash --serve SOCKET"
+//
+// Opens C connections to the server and keeps one command in flight on each
+// until N requests have completed, then prints requests/s and the latency
+// distribution seen by the client.
+//
+//   ./enseash_load SOCKET [-c CONNECTIONS] [-n REQUESTS] [command...]
+//
+// The frame layout must match the server section of enseash_q7.c.
+
+#include <unistd.h>     // read, write, close
+#include <string.h>     // strlen, memset, memcpy, strcmp
+#include <stdlib.h>     // malloc, qsort, EXIT_FAILURE
+#include <time.h>       // clock_gettime
+#include <errno.h>
+#include <poll.h>       // poll
+#include <sys/socket.h> // socket, connect
+#include <sys/un.h>     // struct sockaddr_un
+
+#define BUFFER_SIZE 256
+#define OUT_SIZE    512
+#define MAX_CONNS   256
+#define IN_SIZE     (2 * 65536)   // server frames carry up to 64 KiB
+
+enum frame_type { FRAME_CMD = 1, FRAME_STDOUT, FRAME_STDERR, FRAME_EXIT };
+
+struct frame_header {
+    unsigned char type;
+    unsigned char reserved[3];
+    unsigned int len;
+};
+
+struct frame_exit {
+    int status;
+    unsigned int reserved;
+    unsigned long long wall_us;
+    unsigned long long cpu_us;
+};
+
+struct conn {
+    int fd;
+    struct timespec sent;
+    char in[IN_SIZE];      // holds at least one full output frame
+    size_t in_len;
+};
+
+static struct conn conns[MAX_CONNS];
+
+static void safe_write(int fd, const char *str)
+{
+    (void)write(fd, str, strlen(str));
+}
+
+static void append_str(char *dst, size_t *pos, size_t max, const char *src)
+{
+    while (*src && *pos + 1 < max) dst[(*pos)++] = *src++;
+    dst[*pos] = '\0';
+}
+
+static void append_num(char *dst, size_t *pos, size_t max, unsigned long long v)
+{
+    char tmp[32];
+    int i = 0;
+
+    if (v == 0) tmp[i++] = '0';
+    while (v > 0) { tmp[i++] = (char)('0' + (v % 10)); v /= 10; }
+    while (i-- > 0 && *pos + 1 < max) dst[(*pos)++] = tmp[i];
+    dst[*pos] = '\0';
+}
+
+// "12.345ms" from microseconds.
+static void append_us(char *dst, size_t *pos, size_t max, unsigned long long us)
+{
+    unsigned long long frac = us % 1000;
+
+    append_num(dst, pos, max, us / 1000);
+    append_str(dst, pos, max, ".");
+    if (frac < 100) append_str(dst, pos, max, "0");
+    if (frac < 10) append_str(dst, pos, max, "0");
+    append_num(dst, pos, max, frac);
+    append_str(dst, pos, max, "ms");
+}
+
+static unsigned long long elapsed_us(struct timespec a, struct timespec b)
+{
+    long sec  = b.tv_sec  - a.tv_sec;
+    long nsec = b.tv_nsec - a.tv_nsec;
+    if (nsec < 0) { nsec += 1000000000L; sec--; }
+    return (unsigned long long)sec * 1000000ULL + (unsigned long long)nsec / 1000ULL;
+}
+
+static int parse_num(const char *s)
+{
+    int v = 0;
+    for (; *s >= '0' && *s <= '9'; s++) v = v * 10 + (*s - '0');
+    return v;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+static int connect_to(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_cmd(struct conn *c, const char *cmd)
+{
+    char frame[sizeof(struct frame_header) + BUFFER_SIZE];
+    struct frame_header h;
+    size_t len = strlen(cmd);
+
+    memset(&h, 0, sizeof(h));
+    h.type = FRAME_CMD;
+    h.len = (unsigned int)len;
+    memcpy(frame, &h, sizeof(h));
+    memcpy(frame + sizeof(h), cmd, len);
+
+    clock_gettime(CLOCK_MONOTONIC, &c->sent);
+    return write(c->fd, frame, sizeof(h) + len) == (ssize_t)(sizeof(h) + len) ? 0 : -1;
+}
+
+// Consume buffered frames. Returns 1 when the exit frame was seen.
+static int take_frames(struct conn *c, struct frame_exit *e)
+{
+    struct frame_header h;
+
+    while (c->in_len >= sizeof(h)) {
+        memcpy(&h, c->in, sizeof(h));
+        if (c->in_len < sizeof(h) + h.len) return 0;
+
+        int done = (h.type == FRAME_EXIT && h.len == sizeof(*e));
+        if (done) memcpy(e, c->in + sizeof(h), sizeof(*e));
+
+        c->in_len -= sizeof(h) + h.len;
+        memmove(c->in, c->in + sizeof(h) + h.len, c->in_len);
+        if (done) return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int nconn = 4;
+    int total = 1000;
+    char cmd[BUFFER_SIZE];
+    size_t pos = 0;
+
+    if (argc < 2) {
+        safe_write(STDERR_FILENO, "Usage: enseash_load SOCKET [-c CONNECTIONS] [-n REQUESTS] [command...]\n");
+        return EXIT_FAILURE;
+    }
+
+    int i = 2;
+    for (; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-c") == 0) nconn = parse_num(argv[i + 1]);
+        else if (strcmp(argv[i], "-n") == 0) total = parse_num(argv[i + 1]);
+        else break;
+    }
+    cmd[0] = '\0';
+    for (; i < argc; i++) {
+        append_str(cmd, &pos, sizeof(cmd), argv[i]);
+        if (i + 1 < argc) append_str(cmd, &pos, sizeof(cmd), " ");
+    }
+    if (cmd[0] == '\0') append_str(cmd, &pos, sizeof(cmd), "true");
+    if (nconn < 1) nconn = 1;
+    if (nconn > MAX_CONNS) nconn = MAX_CONNS;
+    if (total < 1) total = 1;
+
+    unsigned long long *lat = malloc((size_t)total * sizeof(*lat));
+    struct pollfd pfds[MAX_CONNS];
+    if (lat == NULL) return EXIT_FAILURE;
+
+    for (int k = 0; k < nconn; k++) {
+        conns[k].fd = connect_to(argv[1]);
+        if (conns[k].fd < 0) {
+            safe_write(STDERR_FILENO, "Error: cannot connect\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct timespec t0, t1;
+    int sent = 0, done = 0, failed = 0;
+    unsigned long long server_us = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int k = 0; k < nconn && sent < total; k++, sent++) {
+        if (send_cmd(&conns[k], cmd) < 0) return EXIT_FAILURE;
+    }
+
+    while (done < total) {
+        for (int k = 0; k < nconn; k++) {
+            pfds[k].fd = conns[k].fd;
+            pfds[k].events = POLLIN;
+        }
+        if (poll(pfds, (nfds_t)nconn, -1) < 0) {
+            if (errno == EINTR) continue;
+            return EXIT_FAILURE;
+        }
+
+        for (int k = 0; k < nconn; k++) {
+            struct conn *c = &conns[k];
+            if (!(pfds[k].revents & (POLLIN | POLLHUP))) continue;
+
+            ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+            if (n <= 0) {
+                safe_write(STDERR_FILENO, "Error: server closed the connection\n");
+                return EXIT_FAILURE;
+            }
+            c->in_len += (size_t)n;
+
+            struct frame_exit e;
+            while (take_frames(c, &e)) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                lat[done++] = elapsed_us(c->sent, now);
+                server_us += e.wall_us;
+                if (e.status != 0) failed++;
+
+                if (sent < total) {
+                    if (send_cmd(c, cmd) < 0) return EXIT_FAILURE;
+                    sent++;
+                }
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    qsort(lat, (size_t)total, sizeof(*lat), cmp_ull);
+    unsigned long long wall = elapsed_us(t0, t1);
+
+    char out[OUT_SIZE];
+    pos = 0;
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "requests: ");
+    append_num(out, &pos, sizeof(out), (unsigned long long)total);
+    append_str(out, &pos, sizeof(out), " (non-zero status: ");
+    append_num(out, &pos, sizeof(out), (unsigned long long)failed);
+    append_str(out, &pos, sizeof(out), ")  connections: ");
+    append_num(out, &pos, sizeof(out), (unsigned long long)nconn);
+    append_str(out, &pos, sizeof(out), "\nthroughput: ");
+    append_num(out, &pos, sizeof(out), wall ? (unsigned long long)total * 1000000ULL / wall : 0);
+    append_str(out, &pos, sizeof(out), " req/s\nlatency: p50 ");
+    append_us(out, &pos, sizeof(out), lat[(size_t)total * 50 / 100]);
+    append_str(out, &pos, sizeof(out), "  p90 ");
+    append_us(out, &pos, sizeof(out), lat[(size_t)total * 90 / 100]);
+    append_str(out, &pos, sizeof(out), "  p99 ");
+    append_us(out, &pos, sizeof(out), lat[(size_t)total * 99 / 100]);
+    append_str(out, &pos, sizeof(out), "  max ");
+    append_us(out, &pos, sizeof(out), lat[total - 1]);
+    append_str(out, &pos, sizeof(out), "\nserver-side mean: ");
+    append_us(out, &pos, sizeof(out), server_us / (unsigned long long)total);
+    append_str(out, &pos, sizeof(out), "\n");
+    safe_write(STDOUT_FILENO, out);
+
+    for (int k = 0; k < nconn; k++) close(conns[k].fd);
+    free(lat);
+    return 0;
+}
@@ -1,4 +1,7 @@
 // enseash_q7.c - Question 7: handle I/O redirections (< and >) + args + exit/signal + time
+//               + extensions (see README)
+
+#define _GNU_SOURCE     // pipe2, accept4, getdents64 types
 
 #include <unistd.h>     // read, write, fork, execvp, _exit, dup2
 #include <string.h>     // strlen, memset, strcmp, strtok
@@ -8,6 +11,25 @@
 #include <time.h>       // clock_gettime
 #include <errno.h>
 #include <fcntl.h>      // open, O_RDONLY, O_WRONLY, O_CREAT, O_TRUNC
+#include <sys/stat.h>   // fstat, mkdir
+#include <stdio.h>      // rename (no stdio output is used)
+#include <dirent.h>     // DT_DIR, DT_LNK, DT_UNKNOWN
+#include <limits.h>     // PATH_MAX
+#include <sys/syscall.h> // SYS_getdents64
+#include <termios.h>    // tcgetattr, tcsetattr (raw mode line editing)
+#include <sys/mman.h>   // mmap (history file)
+#include <sys/file.h>   // flock
+#include <sys/resource.h> // getrusage, wait4
+#include <sys/socket.h> // socket, bind, listen, accept4 (server mode)
+#include <sys/un.h>     // struct sockaddr_un
+#include <poll.h>       // poll
+#include <signal.h>     // kill, signal
+#include <sys/timerfd.h> // timerfd_create (status line ticker)
+#include <sys/ioctl.h>  // TIOCGWINSZ
+#include <pthread.h>    // compression relay threads
+#include <sys/prctl.h>  // PR_SET_CHILD_SUBREAPER
+#include <elf.h>        // Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn (prefetch)
+#include <sys/inotify.h> // watch-run
 
 #define WELCOME_MESSAGE "Bienvenue dans le Shell ENSEA.\nPour quitter, tapez 'exit'.\n"
 #define BYE_MESSAGE     "Bye bye...\n"
@@ -15,6 +37,58 @@
 #define BUFFER_SIZE  256
 #define PROMPT_SIZE  128
 #define MAX_ARGS     64
+#define PATH_SIZE    512
+#define IO_CHUNK     65536
+
+#define CACHE_DIR_DEFAULT ".enseash-cache"
+#define CACHE_MAGIC       0x45434831u   // "ECH1"
+
+#define GLOB_DIRBUF     (256 * 1024)
+#define DIR_CACHE_SLOTS 32
+
+#define MAX_PATH_DIRS   64
+#define MAX_COMPLETIONS 200
+
+#define HIST_FILE_DEFAULT ".enseash_history"
+#define HIST_MAGIC        0x48534845u   // "EHSH"
+
+#define HIST_BUCKETS    1920    // log-linear buckets covering 64-bit values
+#define STATS_SLOTS     1024
+#define STATS_NAME_SIZE 64
+
+#define SERVE_MAX_CLIENTS 256
+#define SERVE_DEFAULT_JOBS 8
+#define SERVE_HIGH_WATER  (1024 * 1024)   // pending output per client
+
+#define TICKER_DELAY_MS  1000   // short commands never show the status line
+#define TICKER_PERIOD_MS 500
+
+#define ZBLOCK_SIZE   (1024 * 1024)
+#define ZBLOCK_STORED 0x80000000u
+#define ZFILE_MAGIC   "ENZ1"
+#define LZ_HASH_BITS  16
+#define LZ_MIN_MATCH  4
+#define LZ_MAX_OFFSET 65535
+
+#define PREFETCH_QUEUE     8
+#define PREFETCH_MAX_FILES 64    // executable + interpreter + libraries
+#define PREFETCH_ENV_SIZE  4096  // copied PATH / LD_LIBRARY_PATH
+
+#define VAR_SLOTS 1024
+
+#define WATCH_SLOTS       64     // initial watch table size, doubled as needed
+#define WATCH_DEPTH       16
+#define WATCH_DEBOUNCE_MS 200    // quiet period before a re-run
+#define WATCH_KILL_MS     1000   // SIGTERM grace before SIGKILL
+#define WATCH_LOST        64     // named paths waiting to be re-created
+#define WATCH_RETRY_MS    250
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+                      | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+#define FNV_OFFSET 1469598103934665603ULL
+#define FNV_PRIME  1099511628211ULL
+
+enum cache_state { CACHE_NONE, CACHE_HIT, CACHE_MISS };
 
 static void safe_write(int fd, const char *str)
 {
@@ -67,6 +141,44 @@ static void append_num(char *dst, size_t *pos, size_t max, unsigned long long v)
     dst[*pos] = '\0';
 }
 
+// "12.345ms" from microseconds.
+static void append_us(char *dst, size_t *pos, size_t max, unsigned long long us)
+{
+    unsigned long long frac = us % 1000;
+
+    append_num(dst, pos, max, us / 1000);
+    append_str(dst, pos, max, ".");
+    if (frac < 100) append_str(dst, pos, max, "0");
+    if (frac < 10) append_str(dst, pos, max, "0");
+    append_num(dst, pos, max, frac);
+    append_str(dst, pos, max, "ms");
+}
+
+static unsigned long long fnv1a(unsigned long long h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static unsigned long long fnv1a_str(unsigned long long h, const char *s)
+{
+    // hash the terminating NUL too so "ab","c" != "a","bc"
+    return fnv1a(h, s, strlen(s) + 1);
+}
+
+static void append_hex(char *dst, size_t *pos, size_t max, unsigned long long v)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int shift = 60; shift >= 0 && *pos + 1 < max; shift -= 4) {
+        dst[(*pos)++] = digits[(v >> shift) & 0xf];
+    }
+    dst[*pos] = '\0';
+}
+
 static unsigned long long elapsed_ms(struct timespec a, struct timespec b)
 {
     long sec  = b.tv_sec  - a.tv_sec;
@@ -75,7 +187,30 @@ static unsigned long long elapsed_ms(struct timespec a, struct timespec b)
     return (unsigned long long)sec * 1000ULL + (unsigned long long)nsec / 1000000ULL;
 }
 
-static void build_prompt(char *prompt, size_t size, int has_last, int status, unsigned long long ms)
+static unsigned long long elapsed_us(struct timespec a, struct timespec b)
+{
+    long sec  = b.tv_sec  - a.tv_sec;
+    long nsec = b.tv_nsec - a.tv_nsec;
+    if (nsec < 0) { nsec += 1000000000L; sec--; }
+    return (unsigned long long)sec * 1000000ULL + (unsigned long long)nsec / 1000ULL;
+}
+
+// "exit:N", "sign:N" or "unk" for a waitpid status.
+static void append_status(char *dst, size_t *pos, size_t max, int status)
+{
+    if (WIFEXITED(status)) {
+        append_str(dst, pos, max, "exit:");
+        append_num(dst, pos, max, (unsigned long long)WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        append_str(dst, pos, max, "sign:");
+        append_num(dst, pos, max, (unsigned long long)WTERMSIG(status));
+    } else {
+        append_str(dst, pos, max, "unk");
+    }
+}
+
+static void build_prompt(char *prompt, size_t size, int has_last, int status, unsigned long long ms,
+                         int cache, unsigned long long saved_ms)
 {
     size_t pos = 0;
     prompt[0] = '\0';
@@ -87,19 +222,20 @@ static void build_prompt(char *prompt, size_t size, int has_last, int status, un
 
     append_str(prompt, &pos, size, "enseash [");
 
-    if (WIFEXITED(status)) {
-        append_str(prompt, &pos, size, "exit:");
-        append_num(prompt, &pos, size, (unsigned long long)WEXITSTATUS(status));
-    } else if (WIFSIGNALED(status)) {
-        append_str(prompt, &pos, size, "sign:");
-        append_num(prompt, &pos, size, (unsigned long long)WTERMSIG(status));
-    } else {
-        append_str(prompt, &pos, size, "unk");
-    }
-
+    append_status(prompt, &pos, size, status);
     append_str(prompt, &pos, size, "|");
     append_num(prompt, &pos, size, ms);
-    append_str(prompt, &pos, size, "ms] % ");
+    append_str(prompt, &pos, size, "ms");
+
+    if (cache == CACHE_HIT) {
+        append_str(prompt, &pos, size, "|cache:hit -");
+        append_num(prompt, &pos, size, saved_ms);
+        append_str(prompt, &pos, size, "ms");
+    } else if (cache == CACHE_MISS) {
+        append_str(prompt, &pos, size, "|cache:miss");
+    }
+
+    append_str(prompt, &pos, size, "] % ");
 }
 
 // Split on spaces/tabs. Modifies line in-place.
@@ -183,78 +319,4512 @@ static int setup_redirections(char *argv[], int *argc)
     return 0;
 }
 
-int main(void)
+// ---------------------------------------------------------------------------
+// Glob expansion (*, ?, [...], **)
+//
+// Directories are read in bulk with the raw getdents64 syscall and each
+// listing is kept in a small cache keyed on (dev, ino). A cached listing is
+// reused only while the directory mtime is unchanged.
+// ---------------------------------------------------------------------------
+
+// Growable, NULL-terminated argv. Every string is owned (strdup).
+struct arg_list {
+    char **v;
+    int argc;
+    int cap;
+};
+
+static int arg_push(struct arg_list *l, const char *s)
 {
-    char buffer[BUFFER_SIZE];
-    char prompt[PROMPT_SIZE];
+    if (l->argc + 2 > l->cap) {
+        int cap = l->cap ? l->cap * 2 : 16;
+        char **v = realloc(l->v, (size_t)cap * sizeof(char *));
+        if (v == NULL) return -1;
+        l->v = v;
+        l->cap = cap;
+    }
+    char *copy = strdup(s);
+    if (copy == NULL) return -1;
+    l->v[l->argc++] = copy;
+    l->v[l->argc] = NULL;
+    return 0;
+}
 
-    int has_last = 0;
-    int last_status = 0;
-    unsigned long long last_ms = 0;
+static void arg_free(struct arg_list *l)
+{
+    for (int i = 0; i < l->argc; i++) free(l->v[i]);
+    free(l->v);
+    l->v = NULL;
+    l->argc = l->cap = 0;
+}
 
-    safe_write(STDOUT_FILENO, WELCOME_MESSAGE);
+struct raw_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
 
-    while (1) {
-        build_prompt(prompt, sizeof(prompt), has_last, last_status, last_ms);
-        safe_write(STDOUT_FILENO, prompt);
+struct dir_listing {
+    int used;
+    int pinned;        // > 0 while a caller iterates it
+    int racy;          // mtime too recent to trust next time
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    unsigned long long last_use;
+    char *names;       // NUL separated names
+    size_t names_len, names_cap;
+    size_t *offsets;   // offsets[i] = start of name i in names
+    unsigned char *types;
+    size_t count, cap;
+};
 
-        memset(buffer, 0, sizeof(buffer));
-        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer) - 1);
+static struct dir_listing dir_cache[DIR_CACHE_SLOTS];
+static unsigned long long dir_cache_clock;
 
-        if (n <= 0) {
-            safe_write(STDOUT_FILENO, BYE_MESSAGE);
-            break;
+static void dir_listing_clear(struct dir_listing *d)
+{
+    free(d->names);
+    free(d->offsets);
+    free(d->types);
+    memset(d, 0, sizeof(*d));
+}
+
+static int dir_listing_add(struct dir_listing *d, const char *name, unsigned char type)
+{
+    size_t len = strlen(name) + 1;
+
+    if (d->names_len + len > d->names_cap) {
+        size_t cap = d->names_cap ? d->names_cap * 2 : 4096;
+        while (cap < d->names_len + len) cap *= 2;
+        char *p = realloc(d->names, cap);
+        if (p == NULL) return -1;
+        d->names = p;
+        d->names_cap = cap;
+    }
+    if (d->count == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        size_t *o = realloc(d->offsets, cap * sizeof(size_t));
+        if (o == NULL) return -1;
+        d->offsets = o;
+        unsigned char *t = realloc(d->types, cap);
+        if (t == NULL) return -1;
+        d->types = t;
+        d->cap = cap;
+    }
+
+    memcpy(d->names + d->names_len, name, len);
+    d->offsets[d->count] = d->names_len;
+    d->types[d->count] = type;
+    d->names_len += len;
+    d->count++;
+    return 0;
+}
+
+static int dir_listing_read(struct dir_listing *d, const char *path)
+{
+    static char buf[GLOB_DIRBUF];
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
         }
+        if (n == 0) break;
 
-        buffer[n] = '\0';
-        strip_eol(buffer);
-        trim_spaces(buffer);
+        for (long off = 0; off < n; ) {
+            struct raw_dirent64 *e = (struct raw_dirent64 *)(buf + off);
+            off += e->d_reclen;
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+            if (dir_listing_add(d, e->d_name, e->d_type) < 0) {
+                close(fd);
+                return -1;
+            }
+        }
+    }
 
-        if (buffer[0] == '\0') continue;
+    close(fd);
+    return 0;
+}
 
-        if (strcmp(buffer, "exit") == 0) {
-            safe_write(STDOUT_FILENO, BYE_MESSAGE);
+// Return the listing of path, from the cache when still valid.
+// The result is pinned: release it with dir_release().
+static struct dir_listing *dir_list(const char *path)
+{
+    struct stat st;
+    struct dir_listing *slot = NULL;
+
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) return NULL;
+
+    for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+        struct dir_listing *d = &dir_cache[i];
+        if (d->used && d->dev == st.st_dev && d->ino == st.st_ino) {
+            if (!d->racy && d->mtime.tv_sec == st.st_mtim.tv_sec
+                && d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                d->last_use = ++dir_cache_clock;
+                d->pinned++;
+                return d;
+            }
+            if (d->pinned == 0) slot = d;   // stale: refill in place
             break;
         }
+    }
 
-        char *argv[MAX_ARGS];
-        int argc = parse_args(buffer, argv, MAX_ARGS);
-        if (argc == 0) continue;
+    if (slot == NULL) {
+        for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+            struct dir_listing *d = &dir_cache[i];
+            if (d->pinned) continue;
+            if (slot == NULL || !d->used || (slot->used && d->last_use < slot->last_use)) slot = d;
+            if (!d->used) break;
+        }
+    }
 
-        struct timespec t0, t1;
-        clock_gettime(CLOCK_MONOTONIC, &t0);
+    struct dir_listing *d = slot;
+    if (d == NULL) {
+        // every slot is pinned (very deep ** walk): use a transient listing
+        d = calloc(1, sizeof(*d));
+        if (d == NULL) return NULL;
+    } else {
+        dir_listing_clear(d);
+    }
 
-        pid_t pid = fork();
-        if (pid < 0) {
-            safe_write(STDERR_FILENO, "Error: fork failed.\n");
-            continue;
+    if (dir_listing_read(d, path) < 0) {
+        dir_listing_clear(d);
+        if (slot == NULL) free(d);
+        return NULL;
+    }
+
+    // A directory changed within the same mtime tick as the read would look
+    // unchanged next time, so recent listings are not trusted for reuse.
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    d->used = (slot != NULL);
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->mtime = st.st_mtim;
+    d->racy = st.st_mtim.tv_sec >= now.tv_sec - 1;
+    d->last_use = ++dir_cache_clock;
+    d->pinned = 1;
+    return d;
+}
+
+static void dir_release(struct dir_listing *d)
+{
+    if (!d->used) {
+        dir_listing_clear(d);
+        free(d);
+        return;
+    }
+    d->pinned--;
+}
+
+static int has_glob(const char *s)
+{
+    return strpbrk(s, "*?[") != NULL;
+}
+
+// *pp points at '['. On a well-formed class *pp is moved past ']'.
+// Returns 1 if c matches, 0 if not, -1 if the class is unterminated.
+static int match_bracket(const char **pp, char c)
+{
+    const char *p = *pp + 1;
+    int negate = 0, matched = 0;
+
+    if (*p == '!' || *p == '^') { negate = 1; p++; }
+    if (*p == ']') { matched = (c == ']'); p++; }   // leading ] is literal
+
+    while (*p != '\0' && *p != ']') {
+        if (p[1] == '-' && p[2] != '\0' && p[2] != ']') {
+            if ((unsigned char)c >= (unsigned char)p[0] && (unsigned char)c <= (unsigned char)p[2]) {
+                matched = 1;
+            }
+            p += 3;
+        } else {
+            if (c == *p) matched = 1;
+            p++;
         }
+    }
+
+    if (*p != ']') return -1;
+    *pp = p + 1;
+    return matched != negate;
+}
+
+// Match one path component against pattern p (stops at '/' or '\0').
+static int glob_match(const char *p, const char *s)
+{
+    const char *star_p = NULL, *star_s = NULL;
 
-        if (pid == 0) {
-            // Child: setup redirections then exec
-            if (setup_redirections(argv, &argc) < 0) {
-                _exit(EXIT_FAILURE);
+    while (*s != '\0') {
+        if (*p == '*') {
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+        if (*p == '?') {
+            p++;
+            s++;
+            continue;
+        }
+        if (*p == '[') {
+            const char *q = p;
+            int m = match_bracket(&q, *s);
+            if (m == 1) {
+                p = q;
+                s++;
+                continue;
             }
-            if (argc == 0 || argv[0] == NULL) {
-                safe_write(STDERR_FILENO, "Error: empty command\n");
-                _exit(EXIT_FAILURE);
+            if (m == -1 && *s == '[') {   // unterminated: literal '['
+                p++;
+                s++;
+                continue;
             }
+        } else if (*p != '/' && *p != '\0' && *p == *s) {
+            p++;
+            s++;
+            continue;
+        }
 
-            execvp(argv[0], argv);
-            safe_write(STDERR_FILENO, "Error: execvp failed.\n");
-            _exit(EXIT_FAILURE);
-        } else {
-            int w;
-            do { w = waitpid(pid, &last_status, 0); } while (w == -1 && errno == EINTR);
+        if (star_p == NULL) return 0;
+        p = star_p;
+        s = ++star_s;
+    }
 
-            clock_gettime(CLOCK_MONOTONIC, &t1);
+    while (*p == '*') p++;
+    return *p == '\0' || *p == '/';
+}
+
+static int glob_walk(char *path, size_t len, const char *pat, struct arg_list *out);
+
+// Whether the entry at path, of getdents type type, is (or links to) a directory.
+static int glob_is_dir(const char *path, unsigned char type)
+{
+    struct stat st;
+
+    if (type == DT_DIR) return 1;
+    if (type != DT_LNK && type != DT_UNKNOWN) return 0;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Apply one wildcard component (comp..end) to every entry of dir path.
+// dir_only: the component ended with '/', so only directories match and
+// they keep the slash ("*/" gives "d1/").
+static int glob_component(char *path, size_t len, const char *comp, const char *rest,
+                          int dir_only, struct arg_list *out)
+{
+    struct dir_listing *d = dir_list(len ? path : ".");
+    if (d == NULL) return 0;
+
+    int r = 0;
+    for (size_t i = 0; i < d->count && r == 0; i++) {
+        const char *name = d->names + d->offsets[i];
+        size_t nlen = strlen(name);
+
+        if (name[0] == '.' && comp[0] != '.') continue;   // hidden files need an explicit dot
+        if (!glob_match(comp, name)) continue;
+        if (len + nlen + 2 > PATH_MAX) continue;
+
+        memcpy(path + len, name, nlen + 1);
+        if (*rest == '\0') {
+            if (dir_only) {
+                if (!glob_is_dir(path, d->types[i])) continue;
+                path[len + nlen] = '/';
+                path[len + nlen + 1] = '\0';
+            }
+            r = arg_push(out, path);
+        } else if (d->types[i] == DT_DIR || d->types[i] == DT_LNK || d->types[i] == DT_UNKNOWN) {
+            path[len + nlen] = '/';
+            path[len + nlen + 1] = '\0';
+            r = glob_walk(path, len + nlen + 1, rest, out);
+        }
+    }
+
+    path[len] = '\0';
+    dir_release(d);
+    return r;
+}
 
-            if (w > 0) {
-                last_ms = elapsed_ms(t0, t1);
-                has_last = 1;
+// "**": zero or more directories, never following symlinks.
+static int glob_globstar(char *path, size_t len, const char *rest, struct arg_list *out)
+{
+    int r = glob_walk(path, len, *rest ? rest : "*", out);
+    if (r < 0) return r;
+
+    struct dir_listing *d = dir_list(len ? path : ".");
+    if (d == NULL) return 0;
+
+    for (size_t i = 0; i < d->count && r == 0; i++) {
+        const char *name = d->names + d->offsets[i];
+        size_t nlen = strlen(name);
+        unsigned char type = d->types[i];
+
+        if (name[0] == '.') continue;
+        if (len + nlen + 2 > PATH_MAX) continue;
+
+        memcpy(path + len, name, nlen + 1);
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) type = DT_DIR;
+        }
+        if (type != DT_DIR) continue;
+
+        path[len + nlen] = '/';
+        path[len + nlen + 1] = '\0';
+        r = glob_globstar(path, len + nlen + 1, rest, out);
+    }
+
+    path[len] = '\0';
+    dir_release(d);
+    return r;
+}
+
+// path[0..len) is the already resolved prefix, pat the remaining pattern.
+static int glob_walk(char *path, size_t len, const char *pat, struct arg_list *out)
+{
+    while (*pat == '/') pat++;
+
+    const char *end = strchr(pat, '/');
+    size_t clen = end ? (size_t)(end - pat) : strlen(pat);
+    const char *rest = end ? end + 1 : pat + clen;
+    while (*rest == '/') rest++;
+    int dir_only = end != NULL && *rest == '\0';   // last component, with a trailing '/'
+
+    if (clen == 2 && pat[0] == '*' && pat[1] == '*') {
+        return glob_globstar(path, len, dir_only ? "*/" : rest, out);
+    }
+
+    int wild = 0;
+    for (size_t i = 0; i < clen; i++) {
+        if (pat[i] == '*' || pat[i] == '?' || pat[i] == '[') wild = 1;
+    }
+    if (wild) return glob_component(path, len, pat, rest, dir_only, out);
+
+    // literal component: no directory scan needed
+    if (len + clen + 2 > PATH_MAX) return 0;
+    memcpy(path + len, pat, clen);
+    len += clen;
+    path[len] = '\0';
+
+    if (*rest == '\0') {
+        struct stat st;
+        int r = 0;
+        if (dir_only) {
+            if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                path[len] = '/';
+                path[len + 1] = '\0';
+                r = arg_push(out, path);
             }
+        } else if (lstat(path, &st) == 0) {
+            r = arg_push(out, path);
+        }
+        path[len - clen] = '\0';
+        return r;
+    }
+
+    path[len++] = '/';
+    path[len] = '\0';
+    int r = glob_walk(path, len, rest, out);
+    path[len - clen - 1] = '\0';
+    return r;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Expand every glob token of argv into out (sorted per token).
+// Tokens without matches and redirection filenames are kept literally.
+static int expand_globs(char *argv[], int argc, struct arg_list *out)
+{
+    static char path[PATH_MAX];
+
+    for (int i = 0; i < argc; i++) {
+        int is_target = i > 0 && (strcmp(argv[i - 1], "<") == 0 || strcmp(argv[i - 1], ">") == 0);
+
+        if (is_target || !has_glob(argv[i])) {
+            if (arg_push(out, argv[i]) < 0) return -1;
+            continue;
+        }
+
+        int start = out->argc;
+        size_t len = 0;
+        if (argv[i][0] == '/') path[len++] = '/';
+        path[len] = '\0';
+
+        if (glob_walk(path, len, argv[i], out) < 0) return -1;
+
+        if (out->argc == start) {
+            if (arg_push(out, argv[i]) < 0) return -1;
+        } else {
+            qsort(out->v + start, (size_t)(out->argc - start), sizeof(char *), cmp_str);
         }
     }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Phase tracing (ENSEASH_PHASES=FILE)
+//
+// Splits the shell's own time into phases with a lap clock: phase_lap(p)
+// charges the time since the previous lap to p. Totals are written to FILE
+// at exit for enseash_bench.c. Costs nothing when the variable is unset.
+// ---------------------------------------------------------------------------
+
+enum phase { PH_PROMPT, PH_INPUT, PH_PARSE, PH_FORK, PH_EXEC, PH_WAIT, PH_OTHER, PH_COUNT };
+
+static const char *phase_names[PH_COUNT] = {
+    "prompt", "input", "parse", "fork", "exec", "wait", "other"
+};
+
+static int phases_on;
+static unsigned long long phase_ns[PH_COUNT];
+static unsigned long long phase_cmds;
+static struct timespec phase_mark;
+
+static void phase_lap(int ph)
+{
+    struct timespec now;
+
+    if (!phases_on) return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    phase_ns[ph] += (unsigned long long)(now.tv_sec - phase_mark.tv_sec) * 1000000000ULL
+                  + (unsigned long long)now.tv_nsec - (unsigned long long)phase_mark.tv_nsec;
+    phase_mark = now;
+}
+
+static void phase_start(void)
+{
+    phases_on = getenv("ENSEASH_PHASES") != NULL;
+    if (phases_on) clock_gettime(CLOCK_MONOTONIC, &phase_mark);
+}
+
+// "commands N" then one "<phase> <total ns>" line per phase.
+static void phase_dump(void)
+{
+    const char *file = getenv("ENSEASH_PHASES");
+    char out[64];
+    size_t pos = 0;
+
+    if (!phases_on || file == NULL) return;
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "commands ");
+    append_num(out, &pos, sizeof(out), phase_cmds);
+    append_str(out, &pos, sizeof(out), "\n");
+    safe_write(fd, out);
+
+    for (int i = 0; i < PH_COUNT; i++) {
+        pos = 0;
+        out[0] = '\0';
+        append_str(out, &pos, sizeof(out), phase_names[i]);
+        append_str(out, &pos, sizeof(out), " ");
+        append_num(out, &pos, sizeof(out), phase_ns[i]);
+        append_str(out, &pos, sizeof(out), "\n");
+        safe_write(fd, out);
+    }
+    close(fd);
+}
+
+// ---------------------------------------------------------------------------
+// Live status line (ENSEASH_TICKER=1)
+//
+// While a command runs, a timerfd wakes the shell once per period and the
+// bottom terminal row shows elapsed time, CPU% and RSS of the child (from
+// /proc/<pid>/stat). The rest of the screen becomes a scroll region, so the
+// child's output scrolls above the status line instead of over it. Each
+// update is a single write() bracketed by cursor save/restore.
+// ---------------------------------------------------------------------------
+
+static int ticker_on = -1;   // -1: not decided yet
+
+static int ticker_enabled(void)
+{
+    if (ticker_on < 0) {
+        const char *v = getenv("ENSEASH_TICKER");
+        ticker_on = v != NULL && strcmp(v, "0") != 0 && isatty(STDERR_FILENO);
+    }
+    return ticker_on;
+}
+
+// utime + stime (clock ticks) and RSS (pages) from /proc/<pid>/stat.
+static int proc_sample(pid_t pid, unsigned long long *ticks, unsigned long long *rss)
+{
+    char path[64], buf[1024];
+    size_t pos = 0;
+
+    path[0] = '\0';
+    append_str(path, &pos, sizeof(path), "/proc/");
+    append_num(path, &pos, sizeof(path), (unsigned long long)pid);
+    append_str(path, &pos, sizeof(path), "/stat");
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+
+    // comm may contain spaces: fields are counted after the last ')'
+    char *p = strrchr(buf, ')');
+    if (p == NULL) return -1;
+
+    unsigned long long field[22] = { 0 };
+    int idx = 0;   // field[0] = state (field 3 in proc(5))
+    for (p++; *p != '\0' && idx < 22; ) {
+        while (*p == ' ') p++;
+        unsigned long long v = 0;
+        while (*p >= '0' && *p <= '9') v = v * 10 + (unsigned long long)(*p++ - '0');
+        while (*p != ' ' && *p != '\0') p++;
+        field[idx++] = v;
+    }
+    if (idx < 22) return -1;
 
+    *ticks = field[11] + field[12];   // utime, stime
+    *rss = field[21];
     return 0;
 }
+
+static void ticker_draw(pid_t pid, int rows, int cols, unsigned long long ms, unsigned int cpu_pct,
+                        unsigned long long rss_kb)
+{
+    char text[128], out[256];
+    size_t pos = 0;
+
+    text[0] = '\0';
+    append_str(text, &pos, sizeof(text), "enseash: running ");
+    append_num(text, &pos, sizeof(text), ms / 1000);
+    append_str(text, &pos, sizeof(text), ".");
+    append_num(text, &pos, sizeof(text), (ms / 100) % 10);
+    append_str(text, &pos, sizeof(text), "s | cpu ");
+    append_num(text, &pos, sizeof(text), cpu_pct);
+    append_str(text, &pos, sizeof(text), "% | rss ");
+    append_num(text, &pos, sizeof(text), rss_kb / 1024);
+    append_str(text, &pos, sizeof(text), "MB | pid ");
+    append_num(text, &pos, sizeof(text), (unsigned long long)pid);
+    if (cols > 1 && pos >= (size_t)cols) text[cols - 1] = '\0';
+
+    pos = 0;
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "\x1b" "7\x1b[");
+    append_num(out, &pos, sizeof(out), (unsigned long long)rows);
+    append_str(out, &pos, sizeof(out), ";1H\x1b[2K\x1b[7m");
+    append_str(out, &pos, sizeof(out), text);
+    append_str(out, &pos, sizeof(out), "\x1b[0m\x1b" "8");
+    (void)write(STDERR_FILENO, out, pos);
+}
+
+// Reserve the bottom row: scroll one line (keeping the column), then limit
+// the scroll region to rows 1..rows-1.
+static void ticker_setup(int rows)
+{
+    char out[64];
+    size_t pos = 0;
+
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "\x1b" "D\x1b[1A\x1b" "7\x1b[1;");
+    append_num(out, &pos, sizeof(out), (unsigned long long)(rows - 1));
+    append_str(out, &pos, sizeof(out), "r\x1b" "8");
+    (void)write(STDERR_FILENO, out, pos);
+}
+
+static void ticker_teardown(int rows)
+{
+    char out[64];
+    size_t pos = 0;
+
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "\x1b" "7\x1b[");
+    append_num(out, &pos, sizeof(out), (unsigned long long)rows);
+    append_str(out, &pos, sizeof(out), ";1H\x1b[2K\x1b[r\x1b" "8");
+    (void)write(STDERR_FILENO, out, pos);
+}
+
+// Wait for pid while updating the status line. Returns what wait4
+// returns, or -2 if the ticker cannot run (caller then waits normally).
+static int ticker_wait(pid_t pid, int *status, struct rusage *ru)
+{
+    struct winsize ws;
+    if (ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) < 0 || ws.ws_row < 3) return -2;
+
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (pidfd < 0 || tfd < 0) {
+        if (pidfd >= 0) close(pidfd);
+        if (tfd >= 0) close(tfd);
+        return -2;
+    }
+
+    struct itimerspec its;
+    its.it_value.tv_sec = TICKER_DELAY_MS / 1000;
+    its.it_value.tv_nsec = (TICKER_DELAY_MS % 1000) * 1000000L;
+    its.it_interval.tv_sec = TICKER_PERIOD_MS / 1000;
+    its.it_interval.tv_nsec = (TICKER_PERIOD_MS % 1000) * 1000000L;
+    timerfd_settime(tfd, 0, &its, NULL);
+
+    struct timespec t0, prev_t;
+    unsigned long long prev_ticks = 0;
+    long hz = sysconf(_SC_CLK_TCK);
+    long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    int shown = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    prev_t = t0;
+
+    for (;;) {
+        struct pollfd pfds[2];
+        pfds[0].fd = pidfd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = tfd;
+        pfds[1].events = POLLIN;
+
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfds[0].revents & POLLIN) break;
+        if (!(pfds[1].revents & POLLIN)) continue;
+
+        unsigned long long expirations;
+        (void)read(tfd, &expirations, sizeof(expirations));
+
+        unsigned long long ticks, rss;
+        if (proc_sample(pid, &ticks, &rss) < 0) continue;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        unsigned long long dt_us = elapsed_us(prev_t, now);
+        unsigned int cpu_pct = 0;
+        if (dt_us > 0 && hz > 0) {
+            cpu_pct = (unsigned int)((ticks - prev_ticks) * 100000000ULL / (unsigned long long)hz / dt_us);
+        }
+        prev_ticks = ticks;
+        prev_t = now;
+
+        // re-read the size each time: the window may have been resized
+        if (ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) < 0 || ws.ws_row < 3) continue;
+        if (!shown) {
+            ticker_setup(ws.ws_row);
+            shown = ws.ws_row;
+        }
+        ticker_draw(pid, ws.ws_row, ws.ws_col, elapsed_ms(t0, now), cpu_pct,
+                    rss * (unsigned long long)page_kb);
+    }
+
+    if (shown) ticker_teardown(shown);
+    close(tfd);
+    close(pidfd);
+
+    int w;
+    do { w = wait4(pid, status, 0, ru); } while (w == -1 && errno == EINTR);
+    return w;
+}
+
+// ---------------------------------------------------------------------------
+// Process-tree accounting (ENSEASH_SUBREAPER=1 or ENSEASH_SUBREAPER=wait)
+//
+// The shell marks itself PR_SET_CHILD_SUBREAPER, so descendants orphaned by
+// a command are re-parented to it instead of to init. Once the direct child
+// is gone, the shell reaps those orphans with wait4() and adds their rusage to
+// the child's own (which already covers everything the child waited for).
+// Every command leads its own process group, inherited by its descendants:
+// an orphan counts for the command only if it is still in that group. With
+// "wait" the shell blocks until the whole tree has exited; otherwise it lists
+// the ones still running. Those reaped later (before the next command
+// starts, or during it) are reported as late descendants and kept out of
+// that command's report and statistics.
+// ---------------------------------------------------------------------------
+
+enum tree_mode { TREE_OFF, TREE_REPORT, TREE_WAIT };
+
+static int tree_mode = -1;
+
+static int tree_enabled(void)
+{
+    if (tree_mode < 0) {
+        const char *v = getenv("ENSEASH_SUBREAPER");
+        if (v == NULL || strcmp(v, "0") == 0) tree_mode = TREE_OFF;
+        else tree_mode = strcmp(v, "wait") == 0 ? TREE_WAIT : TREE_REPORT;
+    }
+    return tree_mode;
+}
+
+struct tree_usage {
+    unsigned long long cpu_us;
+    long maxrss_kb;             // largest single process in the tree
+    int adopted;                // orphans reaped by the shell
+};
+
+static struct tree_usage tree_late;         // earlier commands' usage, not reported yet
+static unsigned long long tree_late_cpu;    // all late CPU ever reaped (for stats)
+
+static void tree_add(struct tree_usage *t, const struct rusage *ru)
+{
+    t->cpu_us += (unsigned long long)(ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000ULL
+               + (unsigned long long)(ru->ru_utime.tv_usec + ru->ru_stime.tv_usec);
+    if (ru->ru_maxrss > t->maxrss_kb) t->maxrss_kb = ru->ru_maxrss;
+}
+
+// Process group of pid from /proc/<pid>/stat (still readable for a zombie),
+// or -1.
+static pid_t tree_pgid(pid_t pid)
+{
+    char path[64], buf[1024];
+    size_t pos = 0;
+
+    path[0] = '\0';
+    append_str(path, &pos, sizeof(path), "/proc/");
+    append_num(path, &pos, sizeof(path), (unsigned long long)pid);
+    append_str(path, &pos, sizeof(path), "/stat");
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+
+    // "pid (comm) state ppid pgrp ...", comm may contain spaces
+    char *p = strrchr(buf, ')');
+    if (p == NULL) return -1;
+    for (int skip = 0; skip < 3 && *p != '\0'; skip++) {
+        while (*p != ' ' && *p != '\0') p++;
+        while (*p == ' ') p++;
+    }
+    if (*p < '0' || *p > '9') return -1;
+    return (pid_t)atoi(p);
+}
+
+// Give the terminal to process group pg. SIGTTOU is ignored meanwhile: the
+// caller may itself be in a background group.
+static void tree_foreground(pid_t pg)
+{
+    struct sigaction ign, old;
+
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigemptyset(&ign.sa_mask);
+    sigaction(SIGTTOU, &ign, &old);
+    tcsetpgrp(STDIN_FILENO, pg);
+    sigaction(SIGTTOU, &old, NULL);
+}
+
+// Reap adopted descendants: those in process group pgid into t, the others
+// (left by an earlier command, all of them when t is NULL) into tree_late.
+// Blocks until none is left when wait is set.
+static void tree_reap(struct tree_usage *t, pid_t pgid, int wait)
+{
+    struct rusage ru;
+    int st;
+
+    for (;;) {
+        siginfo_t si;
+        si.si_pid = 0;
+        // WNOWAIT: the group is read from /proc before the zombie goes away
+        if (waitid(P_ALL, 0, &si, WEXITED | WNOWAIT | (wait ? 0 : WNOHANG)) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (si.si_pid == 0) break;
+
+        int ours = t != NULL && tree_pgid(si.si_pid) == pgid;
+        pid_t p;
+        do { p = wait4(si.si_pid, &st, 0, &ru); } while (p < 0 && errno == EINTR);
+        if (p <= 0) break;
+
+        if (ours) {
+            tree_add(t, &ru);
+            t->adopted++;
+        } else {
+            unsigned long long before = tree_late.cpu_us;
+            tree_add(&tree_late, &ru);
+            tree_late.adopted++;
+            tree_late_cpu += tree_late.cpu_us - before;
+        }
+    }
+}
+
+// "enseash: late descendants cpu 298.581ms | peak rss 1MB | reaped 2"
+static void tree_late_report(void)
+{
+    char out[BUFFER_SIZE];
+    size_t pos = 0;
+
+    if (tree_late.adopted == 0) return;
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "enseash: late descendants cpu ");
+    append_us(out, &pos, sizeof(out), tree_late.cpu_us);
+    append_str(out, &pos, sizeof(out), " | peak rss ");
+    append_num(out, &pos, sizeof(out), (unsigned long long)tree_late.maxrss_kb / 1024);
+    append_str(out, &pos, sizeof(out), "MB | reaped ");
+    append_num(out, &pos, sizeof(out), (unsigned long long)tree_late.adopted);
+    append_str(out, &pos, sizeof(out), "\n");
+    safe_write(STDERR_FILENO, out);
+    memset(&tree_late, 0, sizeof(tree_late));
+}
+
+// Before a command: reap what earlier commands left and has exited since,
+// so it is not charged to the new one.
+static void tree_collect_late(void)
+{
+    if (tree_enabled() != TREE_REPORT) return;
+    tree_reap(NULL, 0, 0);
+    tree_late_report();
+}
+
+// Live children of the shell still in process group pgid, space separated,
+// from /proc. Returns the count listed.
+static int tree_leftovers(pid_t pgid, char *out, size_t *pos, size_t max)
+{
+    char path[64], buf[BUFFER_SIZE];
+    size_t p = 0;
+    int n = 0;
+
+    path[0] = '\0';
+    append_str(path, &p, sizeof(path), "/proc/self/task/");
+    append_num(path, &p, sizeof(path), (unsigned long long)getpid());
+    append_str(path, &p, sizeof(path), "/children");
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) return 0;
+    buf[len] = '\0';
+
+    for (char *s = strtok(buf, " \n"); s != NULL; s = strtok(NULL, " \n")) {
+        if (tree_pgid((pid_t)atoi(s)) != pgid) continue;
+        append_str(out, pos, max, " ");
+        append_str(out, pos, max, s);
+        n++;
+    }
+    return n;
+}
+
+// "enseash: tree cpu 1234.567ms | peak rss 45MB | adopted 3 | running: 812 813"
+static void tree_finish(pid_t pgid, const struct rusage *direct)
+{
+    struct tree_usage t;
+    char out[BUFFER_SIZE * 2];
+    char pids[BUFFER_SIZE];
+    size_t pos = 0, ppos = 0;
+
+    memset(&t, 0, sizeof(t));
+    tree_add(&t, direct);
+    tree_reap(&t, pgid, tree_enabled() == TREE_WAIT);
+
+    pids[0] = '\0';
+    int left = tree_leftovers(pgid, pids, &ppos, sizeof(pids));
+
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "enseash: tree cpu ");
+    append_us(out, &pos, sizeof(out), t.cpu_us);
+    append_str(out, &pos, sizeof(out), " | peak rss ");
+    append_num(out, &pos, sizeof(out), (unsigned long long)t.maxrss_kb / 1024);
+    append_str(out, &pos, sizeof(out), "MB | adopted ");
+    append_num(out, &pos, sizeof(out), (unsigned long long)t.adopted);
+    if (left > 0) {
+        append_str(out, &pos, sizeof(out), " | running:");
+        append_str(out, &pos, sizeof(out), pids);
+    }
+    append_str(out, &pos, sizeof(out), "\n");
+    safe_write(STDERR_FILENO, out);
+    tree_late_report();   // earlier leftovers that exited during this command
+}
+
+// ---------------------------------------------------------------------------
+// Shell variables ($NAME, ${NAME}, $?, $$, export, unset, NAME=value cmd)
+//
+// Variables live in an open-addressing table. Exported ones also own a
+// "NAME=value" string in env_vec, the envp handed to execvpe(): it is built
+// once from environ and then patched in place (replace, append, or swap with
+// the last entry on unset), never rebuilt per command. A per-command
+// override copies the pointer array and patches the copy.
+// ---------------------------------------------------------------------------
+
+struct shell_var {
+    char *name;                 // NULL: free slot
+    char *value;                // NULL: unset (the slot is kept)
+    int env_index;              // position in env_vec, -1 if not exported
+};
+
+static struct shell_var vars[VAR_SLOTS];
+static int n_vars;
+
+static char **env_vec;          // NULL-terminated
+static int env_len, env_cap;
+
+static char **exec_env;         // what exec_child passes: env_vec or an override copy
+static const char *exec_path;   // PATH set by an override, for the execvpe() search
+
+static int var_name_len(const char *s)
+{
+    int n = 0;
+    if (!(s[0] == '_' || (s[0] >= 'a' && s[0] <= 'z') || (s[0] >= 'A' && s[0] <= 'Z'))) return 0;
+    while (s[n] == '_' || (s[n] >= 'a' && s[n] <= 'z') || (s[n] >= 'A' && s[n] <= 'Z')
+           || (s[n] >= '0' && s[n] <= '9')) n++;
+    return n;
+}
+
+// Slot for the first len bytes of name; created when create is set.
+static struct shell_var *var_find(const char *name, size_t len, int create)
+{
+    unsigned long long h = fnv1a(FNV_OFFSET, name, len);
+    unsigned int slot = (unsigned int)(h % VAR_SLOTS);
+
+    for (int probe = 0; probe < VAR_SLOTS; probe++) {
+        struct shell_var *v = &vars[slot];
+        if (v->name == NULL) break;
+        if (strncmp(v->name, name, len) == 0 && v->name[len] == '\0') return v;
+        slot = (slot + 1) % VAR_SLOTS;
+    }
+
+    if (!create || vars[slot].name != NULL || n_vars + 1 >= VAR_SLOTS) return NULL;   // table full
+    char *copy = malloc(len + 1);
+    if (copy == NULL) return NULL;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+
+    vars[slot].name = copy;
+    vars[slot].value = NULL;
+    vars[slot].env_index = -1;
+    n_vars++;
+    return &vars[slot];
+}
+
+static const char *var_get(const char *name, size_t len)
+{
+    struct shell_var *v = var_find(name, len, 0);
+    return v ? v->value : NULL;
+}
+
+static char *env_entry(const char *name, const char *value)
+{
+    size_t nl = strlen(name), vl = strlen(value);
+    char *e = malloc(nl + vl + 2);
+    if (e == NULL) return NULL;
+    memcpy(e, name, nl);
+    e[nl] = '=';
+    memcpy(e + nl + 1, value, vl + 1);
+    return e;
+}
+
+static int env_append(char *entry)
+{
+    if (env_len + 1 >= env_cap) {
+        int cap = env_cap ? env_cap * 2 : 64;
+        char **v = realloc(env_vec, (size_t)cap * sizeof(*v));
+        if (v == NULL) return -1;
+        env_vec = v;
+        env_cap = cap;
+    }
+    env_vec[env_len++] = entry;
+    env_vec[env_len] = NULL;
+    return env_len - 1;
+}
+
+// Set name to value; exported if export is set or it already was.
+static int var_set(const char *name, const char *value, int export)
+{
+    struct shell_var *v = var_find(name, strlen(name), 1);
+    char *val = strdup(value);
+    if (v == NULL || val == NULL) {
+        free(val);
+        safe_write(STDERR_FILENO, "Error: cannot set variable\n");
+        return -1;
+    }
+    free(v->value);
+    v->value = val;
+
+    if (export || v->env_index >= 0) {
+        char *e = env_entry(v->name, val);
+        if (e == NULL) return -1;
+        if (v->env_index >= 0) {
+            free(env_vec[v->env_index]);
+            env_vec[v->env_index] = e;
+        } else if ((v->env_index = env_append(e)) < 0) {
+            free(e);
+            return -1;
+        }
+        setenv(v->name, val, 1);   // keep getenv() users (PATH, ENSEASH_*) in step
+    }
+    return 0;
+}
+
+static void var_unset(const char *name)
+{
+    struct shell_var *v = var_find(name, strlen(name), 0);
+    if (v == NULL || v->value == NULL) return;
+
+    free(v->value);
+    v->value = NULL;
+    if (v->env_index < 0) return;
+
+    // the last entry takes the freed position
+    int idx = v->env_index;
+    free(env_vec[idx]);
+    env_len--;
+    if (idx != env_len) {
+        char *moved = env_vec[env_len];
+        struct shell_var *m = var_find(moved, (size_t)(strchr(moved, '=') - moved), 0);
+        env_vec[idx] = moved;
+        if (m != NULL) m->env_index = idx;
+    }
+    env_vec[env_len] = NULL;
+    v->env_index = -1;
+    unsetenv(name);
+}
+
+static void var_init(void)
+{
+    env_cap = 64;
+    env_vec = calloc((size_t)env_cap, sizeof(*env_vec));
+    if (env_vec == NULL) return;   // exec_child falls back to environ
+
+    for (char **e = environ; *e != NULL; e++) {
+        const char *eq = strchr(*e, '=');
+        if (eq == NULL) continue;
+        struct shell_var *v = var_find(*e, (size_t)(eq - *e), 1);
+        char *entry = strdup(*e);
+        if (v == NULL || entry == NULL || v->value != NULL) {
+            free(entry);
+            continue;
+        }
+        v->value = strdup(eq + 1);
+        v->env_index = env_append(entry);
+    }
+    exec_env = env_vec;
+}
+
+// Expand $NAME, ${NAME}, $? and $$ in place. status is the last wait status.
+// Returns -1 if the result does not fit.
+static int var_expand(char *buf, size_t size, int status)
+{
+    char out[BUFFER_SIZE];
+    size_t pos = 0;
+
+    if (strchr(buf, '$') == NULL) return 0;
+    out[0] = '\0';
+
+    for (const char *p = buf; *p != '\0'; ) {
+        if (*p != '$') {
+            char c[2] = { *p++, '\0' };
+            append_str(out, &pos, sizeof(out), c);
+            continue;
+        }
+
+        const char *name = p + 1;
+        int braces = (*name == '{');
+        if (braces) name++;
+        int len = var_name_len(name);
+
+        if (!braces && name[0] == '?') {
+            int code = WIFEXITED(status) ? WEXITSTATUS(status)
+                     : WIFSIGNALED(status) ? 128 + WTERMSIG(status) : 0;
+            append_num(out, &pos, sizeof(out), (unsigned long long)code);
+            p = name + 1;
+        } else if (!braces && name[0] == '$') {
+            append_num(out, &pos, sizeof(out), (unsigned long long)getpid());
+            p = name + 1;
+        } else if (len > 0 && (!braces || name[len] == '}')) {
+            const char *val = var_get(name, (size_t)len);
+            if (val != NULL) append_str(out, &pos, sizeof(out), val);
+            p = name + len + braces;
+        } else {
+            append_str(out, &pos, sizeof(out), "$");   // not a reference
+            p++;
+        }
+        if (pos + 1 >= sizeof(out) || pos + 1 >= size) return -1;
+    }
+
+    memcpy(buf, out, pos + 1);
+    return 1;
+}
+
+// Number of leading NAME=value words.
+static int var_assignments(char *argv[], int argc)
+{
+    int n = 0;
+    while (n < argc) {
+        int len = var_name_len(argv[n]);
+        if (len == 0 || argv[n][len] != '=') break;
+        n++;
+    }
+    return n;
+}
+
+// envp for "NAME=value ... cmd": env_vec's pointers with the n assignments
+// patched in (the words themselves are used as entries). Sets exec_env.
+static char **env_override(char *argv[], int n)
+{
+    char **v = malloc((size_t)(env_len + n + 1) * sizeof(*v));
+    int len = env_len;
+
+    if (v == NULL) return NULL;
+    memcpy(v, env_vec, (size_t)(env_len + 1) * sizeof(*v));
+    exec_path = NULL;
+
+    for (int i = 0; i < n; i++) {
+        size_t nl = (size_t)var_name_len(argv[i]);
+        struct shell_var *var = var_find(argv[i], nl, 0);
+        if (var != NULL && var->env_index >= 0) {
+            v[var->env_index] = argv[i];
+        } else {
+            v[len++] = argv[i];
+            v[len] = NULL;
+        }
+        if (nl == 4 && strncmp(argv[i], "PATH", 4) == 0) exec_path = argv[i] + 5;
+    }
+    exec_env = v;
+    return v;
+}
+
+static void env_restore(char **v)
+{
+    free(v);
+    exec_env = env_vec;
+    exec_path = NULL;
+}
+
+// Value of name in the environment the next command gets.
+static const char *env_get(const char *name)
+{
+    size_t nl = strlen(name);
+    if (exec_env == NULL) return getenv(name);
+    for (char **e = exec_env; *e != NULL; e++) {
+        if (strncmp(*e, name, nl) == 0 && (*e)[nl] == '=') return *e + nl + 1;
+    }
+    return NULL;
+}
+
+// export [NAME[=value]...]; without arguments, list the environment.
+static void export_builtin(char *argv[], int argc)
+{
+    if (argc == 1) {
+        for (int i = 0; i < env_len; i++) {
+            safe_write(STDOUT_FILENO, "export ");
+            safe_write(STDOUT_FILENO, env_vec[i]);
+            safe_write(STDOUT_FILENO, "\n");
+        }
+        return;
+    }
+    for (int i = 1; i < argc; i++) {
+        int len = var_name_len(argv[i]);
+        if (len == 0 || (argv[i][len] != '\0' && argv[i][len] != '=')) {
+            safe_write(STDERR_FILENO, "Error: export: invalid name\n");
+            continue;
+        }
+        if (argv[i][len] == '=') {
+            argv[i][len] = '\0';
+            var_set(argv[i], argv[i] + len + 1, 1);
+            argv[i][len] = '=';
+        } else {
+            const char *val = var_get(argv[i], (size_t)len);
+            var_set(argv[i], val ? val : "", 1);
+        }
+    }
+}
+
+static void unset_builtin(char *argv[], int argc)
+{
+    for (int i = 1; i < argc; i++) var_unset(argv[i]);
+}
+
+// ---------------------------------------------------------------------------
+// Compressed redirections (">z file", "<z file")
+//
+// The child's stdout (or stdin) is a pipe; a relay thread in the shell
+// compresses what comes out of it into the file (or decompresses the file
+// into it). The codec is a small LZ77 in the LZ4 style: 1 MiB blocks, a
+// 64K-entry hash of 4-byte sequences, 16-bit offsets, greedy matching.
+//
+// File: "ENZ1", then per block: u32 raw length, u32 stored length, data.
+// The top bit of the stored length marks a block kept uncompressed.
+// ---------------------------------------------------------------------------
+
+struct zstream {
+    pthread_t thread;
+    int active;
+    int compress;               // 1: pipe -> file, 0: file -> pipe
+    int file_fd;
+    int pipe_fd;                // our end
+    int child_fd;               // the child's end, closed after fork
+    const char *file;
+    unsigned long long raw_bytes, file_bytes;
+    unsigned long long busy_us; // time spent in the codec
+    int error;
+    unsigned int table[1 << LZ_HASH_BITS];
+};
+
+static size_t lz_bound(size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+static unsigned int read32(const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int lz_hash(unsigned int seq)
+{
+    return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char *lz_put_len(unsigned char *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// Sequence: token (literal length << 4 | match length - 4), extra length
+// bytes, literals, then (except for the last one) offset and extra match bytes.
+static unsigned char *lz_put_seq(unsigned char *op, const unsigned char *lit, size_t nlit,
+                                 size_t offset, size_t mlen)
+{
+    size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    unsigned char *token = op++;
+
+    *token = (unsigned char)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15) op = lz_put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen == 0) return op;   // last literals
+
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+    *token |= (unsigned char)(ml < 15 ? ml : 15);
+    if (ml >= 15) op = lz_put_len(op, ml - 15);
+    return op;
+}
+
+// dst must hold lz_bound(n) bytes. Returns the compressed size.
+static size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst, unsigned int *table)
+{
+    unsigned char *op = dst;
+    size_t ip = 0, anchor = 0;
+
+    memset(table, 0, sizeof(unsigned int) << LZ_HASH_BITS);
+
+    if (n >= LZ_MIN_MATCH + 8) {
+        size_t limit = n - LZ_MIN_MATCH - 4;
+        while (ip < limit) {
+            unsigned int seq = read32(src + ip);
+            unsigned int h = lz_hash(seq);
+            size_t ref = table[h];
+            table[h] = (unsigned int)ip;
+
+            if (ref < ip && ip - ref <= LZ_MAX_OFFSET && read32(src + ref) == seq) {
+                size_t mlen = LZ_MIN_MATCH;
+                while (ip + mlen < n && src[ref + mlen] == src[ip + mlen]) mlen++;
+
+                op = lz_put_seq(op, src + anchor, ip - anchor, ip - ref, mlen);
+                ip += mlen;
+                anchor = ip;
+                if (ip < limit) table[lz_hash(read32(src + ip - 2))] = (unsigned int)(ip - 2);
+            } else {
+                // skip faster through data that does not compress
+                ip += 1 + ((ip - anchor) >> 6);
+            }
+        }
+    }
+
+    op = lz_put_seq(op, src + anchor, n - anchor, 0, 0);
+    return (size_t)(op - dst);
+}
+
+// Returns the decompressed size, or -1 if the block is malformed.
+static long lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap)
+{
+    size_t ip = 0, op = 0;
+
+    while (ip < n) {
+        unsigned int token = src[ip++];
+        size_t nlit = token >> 4;
+
+        if (nlit == 15) {
+            unsigned char b;
+            do {
+                if (ip >= n) return -1;
+                b = src[ip++];
+                nlit += b;
+            } while (b == 255);
+        }
+        if (nlit > n - ip || nlit > cap - op) return -1;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == n) break;   // last sequence has no match
+
+        if (n - ip < 2) return -1;
+        size_t offset = (size_t)src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+        size_t mlen = (token & 15);
+        if (mlen == 15) {
+            unsigned char b;
+            do {
+                if (ip >= n) return -1;
+                b = src[ip++];
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || mlen > cap - op) return -1;
+        if (offset >= mlen) {
+            memcpy(dst + op, dst + op - offset, mlen);
+            op += mlen;
+        } else {
+            // byte by byte: the match overlaps what it produces
+            for (size_t i = 0; i < mlen; i++, op++) dst[op] = dst[op - offset];
+        }
+    }
+    return (long)op;
+}
+
+static ssize_t read_full(int fd, void *buf, size_t n)
+{
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = read(fd, (char *)buf + got, n - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += (size_t)r;
+    }
+    return (ssize_t)got;
+}
+
+static int write_full(int fd, const void *buf, size_t n)
+{
+    size_t done = 0;
+    while (done < n) {
+        ssize_t w = write(fd, (const char *)buf + done, n - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        done += (size_t)w;
+    }
+    return 0;
+}
+
+static void *zstream_compress(struct zstream *z)
+{
+    unsigned char *raw = malloc(ZBLOCK_SIZE);
+    unsigned char *packed = malloc(lz_bound(ZBLOCK_SIZE));
+    ssize_t n;
+
+    if (raw == NULL || packed == NULL || write_full(z->file_fd, ZFILE_MAGIC, 4) < 0) {
+        z->error = 1;
+    } else {
+        z->file_bytes = 4;
+        while ((n = read_full(z->pipe_fd, raw, ZBLOCK_SIZE)) > 0) {
+            struct timespec a, b;
+            unsigned int hdr[2];
+
+            clock_gettime(CLOCK_MONOTONIC, &a);
+            size_t plen = lz_compress(raw, (size_t)n, packed, z->table);
+            clock_gettime(CLOCK_MONOTONIC, &b);
+            z->busy_us += elapsed_us(a, b);
+
+            const unsigned char *data = packed;
+            hdr[0] = (unsigned int)n;
+            hdr[1] = (unsigned int)plen;
+            if (plen >= (size_t)n) {   // incompressible: store as is
+                data = raw;
+                plen = (size_t)n;
+                hdr[1] = (unsigned int)n | ZBLOCK_STORED;
+            }
+
+            if (write_full(z->file_fd, hdr, sizeof(hdr)) < 0 || write_full(z->file_fd, data, plen) < 0) {
+                z->error = 1;
+                break;
+            }
+            z->raw_bytes += (unsigned long long)n;
+            z->file_bytes += sizeof(hdr) + plen;
+        }
+        if (n < 0) z->error = 1;
+    }
+
+    free(raw);
+    free(packed);
+    return NULL;
+}
+
+static void *zstream_decompress(struct zstream *z)
+{
+    unsigned char *raw = malloc(ZBLOCK_SIZE);
+    unsigned char *packed = malloc(lz_bound(ZBLOCK_SIZE));
+    char magic[4];
+
+    if (raw == NULL || packed == NULL || read_full(z->file_fd, magic, 4) != 4
+        || memcmp(magic, ZFILE_MAGIC, 4) != 0) {
+        z->error = 1;
+    } else {
+        z->file_bytes = 4;
+        for (;;) {
+            unsigned int hdr[2];
+            ssize_t r = read_full(z->file_fd, hdr, sizeof(hdr));
+            if (r == 0) break;
+
+            size_t plen = hdr[1] & ~ZBLOCK_STORED;
+            if (r != (ssize_t)sizeof(hdr) || hdr[0] > ZBLOCK_SIZE || plen > lz_bound(ZBLOCK_SIZE)
+                || read_full(z->file_fd, packed, plen) != (ssize_t)plen) {
+                z->error = 1;
+                break;
+            }
+
+            const unsigned char *data = packed;
+            if (!(hdr[1] & ZBLOCK_STORED)) {
+                struct timespec a, b;
+                clock_gettime(CLOCK_MONOTONIC, &a);
+                long n = lz_decompress(packed, plen, raw, ZBLOCK_SIZE);
+                clock_gettime(CLOCK_MONOTONIC, &b);
+                z->busy_us += elapsed_us(a, b);
+                if (n != (long)hdr[0]) {
+                    z->error = 1;
+                    break;
+                }
+                data = raw;
+            } else if (plen != hdr[0]) {
+                z->error = 1;
+                break;
+            }
+
+            z->file_bytes += sizeof(hdr) + plen;
+            z->raw_bytes += hdr[0];
+            // the child may stop reading early (EPIPE): that is not an error
+            if (write_full(z->pipe_fd, data, hdr[0]) < 0) break;
+        }
+    }
+
+    free(raw);
+    free(packed);
+    return NULL;
+}
+
+static void *zstream_main(void *arg)
+{
+    struct zstream *z = arg;
+    void *r = z->compress ? zstream_compress(z) : zstream_decompress(z);
+
+    // closing our end gives the child EOF (or lets it see EPIPE)
+    close(z->pipe_fd);
+    close(z->file_fd);
+    return r;
+}
+
+static int has_zredir(char *argv[], int argc)
+{
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], ">z") == 0 || strcmp(argv[i], "<z") == 0) return 1;
+    }
+    return 0;
+}
+
+// Find "<z FILE" / ">z FILE", open the file and the pipe, drop the tokens.
+// z[0] is the input side, z[1] the output side. Returns -1 on error.
+static int zredir_prepare(char *argv[], int *argc, struct zstream *z)
+{
+    for (int i = 0; i < *argc; ) {
+        int out = strcmp(argv[i], ">z") == 0;
+        if (!out && strcmp(argv[i], "<z") != 0) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= *argc) {
+            safe_write(STDERR_FILENO, out ? "Error: missing filename after >z\n"
+                                          : "Error: missing filename after <z\n");
+            return -1;
+        }
+
+        struct zstream *s = &z[out];
+        int p[2];
+        if (s->active) {
+            close(s->file_fd);
+            close(s->pipe_fd);
+            close(s->child_fd);
+        }
+        s->active = 0;
+
+        s->file = argv[i + 1];
+        s->file_fd = out ? open(s->file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                         : open(s->file, O_RDONLY | O_CLOEXEC);
+        if (s->file_fd < 0) {
+            safe_write(STDERR_FILENO, out ? "Error: cannot open output file\n"
+                                          : "Error: cannot open input file\n");
+            return -1;
+        }
+        if (pipe2(p, O_CLOEXEC) < 0) {
+            close(s->file_fd);
+            return -1;
+        }
+
+        s->compress = out;
+        s->pipe_fd = out ? p[0] : p[1];
+        s->child_fd = out ? p[1] : p[0];
+        s->active = 1;
+
+        remove_two_tokens(argv, argc, i);
+    }
+    return 0;
+}
+
+static void zredir_abort(struct zstream *z)
+{
+    for (int i = 0; i < 2; i++) {
+        if (!z[i].active) continue;
+        close(z[i].file_fd);
+        close(z[i].pipe_fd);
+        close(z[i].child_fd);
+        z[i].active = 0;
+    }
+}
+
+// In the child, before exec_child(): an explicit < or > still wins.
+static void zredir_child(struct zstream *z)
+{
+    if (z[0].active) dup2(z[0].child_fd, STDIN_FILENO);
+    if (z[1].active) dup2(z[1].child_fd, STDOUT_FILENO);
+}
+
+static void zredir_start(struct zstream *z)
+{
+    for (int i = 0; i < 2; i++) {
+        if (!z[i].active) continue;
+        close(z[i].child_fd);
+        if (pthread_create(&z[i].thread, NULL, zstream_main, &z[i]) != 0) {
+            close(z[i].pipe_fd);
+            close(z[i].file_fd);
+            z[i].active = 0;
+            safe_write(STDERR_FILENO, "Error: cannot start compression thread\n");
+        }
+    }
+}
+
+// "enseash: >z out.z 104857600 -> 20971520 bytes (5.00x, 812 MB/s)"
+static void zredir_finish(struct zstream *z)
+{
+    for (int i = 0; i < 2; i++) {
+        if (!z[i].active) continue;
+        pthread_join(z[i].thread, NULL);
+        z[i].active = 0;
+
+        char out[PATH_SIZE + 128];
+        size_t pos = 0;
+        unsigned long long ratio = z[i].file_bytes ? z[i].raw_bytes * 100 / z[i].file_bytes : 0;
+
+        out[0] = '\0';
+        append_str(out, &pos, sizeof(out), "enseash: ");
+        append_str(out, &pos, sizeof(out), z[i].compress ? ">z " : "<z ");
+        append_str(out, &pos, sizeof(out), z[i].file);
+        if (z[i].error) append_str(out, &pos, sizeof(out), " (error)");
+        append_str(out, &pos, sizeof(out), " ");
+        append_num(out, &pos, sizeof(out), z[i].raw_bytes);
+        append_str(out, &pos, sizeof(out), z[i].compress ? " -> " : " <- ");
+        append_num(out, &pos, sizeof(out), z[i].file_bytes);
+        append_str(out, &pos, sizeof(out), " bytes (");
+        append_num(out, &pos, sizeof(out), ratio / 100);
+        append_str(out, &pos, sizeof(out), ".");
+        if (ratio % 100 < 10) append_str(out, &pos, sizeof(out), "0");
+        append_num(out, &pos, sizeof(out), ratio % 100);
+        append_str(out, &pos, sizeof(out), "x, ");
+        append_num(out, &pos, sizeof(out), z[i].busy_us ? z[i].raw_bytes / z[i].busy_us : 0);
+        append_str(out, &pos, sizeof(out), " MB/s)\n");
+        safe_write(STDERR_FILENO, out);
+    }
+}
+
+// Return the filename following operator op ("<" or ">"), or NULL.
+static const char *find_redirection(char *argv[], int argc, const char *op)
+{
+    for (int i = 0; i + 1 < argc; i++) {
+        if (strcmp(argv[i], op) == 0) return argv[i + 1];
+    }
+    return NULL;
+}
+
+// Child side of a launch: redirections then exec. Never returns.
+static void exec_child(char *argv[], int argc)
+{
+    signal(SIGPIPE, SIG_DFL);   // the shell ignores it, the command must not
+
+    if (setup_redirections(argv, &argc) < 0) {
+        _exit(EXIT_FAILURE);
+    }
+    if (argc == 0 || argv[0] == NULL) {
+        safe_write(STDERR_FILENO, "Error: empty command\n");
+        _exit(EXIT_FAILURE);
+    }
+
+    if (exec_path != NULL) setenv("PATH", exec_path, 1);   // execvpe() searches getenv("PATH")
+    execvpe(argv[0], argv, exec_env != NULL ? exec_env : environ);
+    safe_write(STDERR_FILENO, "Error: execvp failed.\n");
+    _exit(EXIT_FAILURE);
+}
+
+// A command started by launch_start() and not yet collected.
+struct launch {
+    pid_t pid;
+    struct timespec t0;
+    struct zstream *z;          // ">z" / "<z" relays, if any
+    char **zargv;
+    int foreground;             // holds the terminal until collected
+};
+
+// Fork and exec one command without waiting for it. With own_group the
+// child leads its own process group (so the whole group can be signalled)
+// and reads /dev/null unless it has a "<". With tree accounting every
+// command gets a group of its own, which tells its descendants apart from
+// an earlier command's; on a terminal that group is made the foreground
+// one. out_fd, unless -1, becomes the child's stdout (a "> file" still
+// wins). Returns 0, or -1 on failure.
+static int launch_start(struct launch *l, char *argv[], int argc, int own_group, int out_fd)
+{
+    int xp[2] = { -1, -1 };
+    int group = own_group || tree_enabled();
+
+    l->foreground = !own_group && tree_enabled() && isatty(STDIN_FILENO);
+
+    // when tracing, a close-on-exec pipe reports the moment exec succeeds
+    if (phases_on && pipe2(xp, O_CLOEXEC) < 0) xp[0] = xp[1] = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &l->t0);
+
+    // ">z" / "<z" are consumed here, on a copy: the caller owns argv
+    l->z = NULL;
+    l->zargv = NULL;
+    if (has_zredir(argv, argc)) {
+        l->z = calloc(2, sizeof(*l->z));
+        l->zargv = malloc((size_t)(argc + 1) * sizeof(*l->zargv));
+        if (l->zargv) {
+            memcpy(l->zargv, argv, (size_t)argc * sizeof(*l->zargv));
+            l->zargv[argc] = NULL;
+            argv = l->zargv;
+        }
+        if (l->z == NULL || l->zargv == NULL || zredir_prepare(argv, &argc, l->z) < 0) {
+            if (l->z) zredir_abort(l->z);
+            free(l->z);
+            free(l->zargv);
+            if (xp[0] >= 0) { close(xp[0]); close(xp[1]); }
+            return -1;
+        }
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        safe_write(STDERR_FILENO, "Error: fork failed.\n");
+        if (xp[0] >= 0) { close(xp[0]); close(xp[1]); }
+        if (l->z) zredir_abort(l->z);
+        free(l->z);
+        free(l->zargv);
+        return -1;
+    }
+
+    if (pid == 0) {
+        if (group) setpgid(0, 0);
+        if (l->foreground) tree_foreground(getpid());
+        if (own_group) {
+            int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (null >= 0) dup2(null, STDIN_FILENO);
+        }
+        if (out_fd >= 0) dup2(out_fd, STDOUT_FILENO);
+        if (l->z) zredir_child(l->z);
+        exec_child(argv, argc);
+    }
+
+    if (group) setpgid(pid, pid);   // both sides, whoever runs first
+    if (l->foreground) tree_foreground(pid);
+    l->pid = pid;
+    if (l->z) zredir_start(l->z);
+    phase_lap(PH_FORK);
+    if (xp[0] >= 0) {
+        char c;
+        close(xp[1]);
+        while (read(xp[0], &c, 1) < 0 && errno == EINTR) { }
+        close(xp[0]);
+        phase_lap(PH_EXEC);
+    }
+    return 0;
+}
+
+// Wait for a launched command (with the status line if ticker is set) and
+// collect its relays. Returns 0 and fills status/ms, or -1 if wait failed.
+static int launch_finish(struct launch *l, int ticker, int *status, unsigned long long *ms)
+{
+    struct timespec t1;
+    struct rusage ru;
+
+    int w = ticker && ticker_enabled() ? ticker_wait(l->pid, status, &ru) : -2;
+    if (w == -2) {
+        do { w = wait4(l->pid, status, 0, &ru); } while (w == -1 && errno == EINTR);
+    }
+
+    if (l->foreground) tree_foreground(getpgrp());
+
+    // before the relays: an orphan may still hold their pipe open
+    if (w > 0 && tree_enabled()) tree_finish(l->pid, &ru);
+
+    if (l->z) {
+        zredir_finish(l->z);   // the stream ends once the child is gone
+        free(l->z);
+        free(l->zargv);
+        l->z = NULL;
+        l->zargv = NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    phase_lap(PH_WAIT);
+
+    if (w <= 0) return -1;
+    *ms = elapsed_ms(l->t0, t1);
+    return 0;
+}
+
+// Fork, exec and wait for one command.
+// Returns 0 and fills status/ms on success, -1 if fork or wait failed.
+static int run_command(char *argv[], int argc, int *status, unsigned long long *ms)
+{
+    struct launch l;
+
+    if (launch_start(&l, argv, argc, 0, -1) < 0) return -1;
+    return launch_finish(&l, 1, status, ms);
+}
+
+// ---------------------------------------------------------------------------
+// File-watch re-run ("watch-run [paths...] -- cmd args...")
+//
+// inotify watches the paths (directories recursively, hidden entries
+// skipped, new subdirectories added as they appear). A burst of events is
+// debounced by a one-shot timerfd that every new event pushes back; when it
+// fires the command is launched again through launch_start(). A change that
+// arrives while a run is in flight cancels it: the run has its own process
+// group, which gets SIGTERM (then SIGKILL). Ctrl+C stops watching.
+//
+// Watches follow inodes, and editors save by renaming a new file over the
+// old one: when a watched path is deleted or moved away, it is watched
+// again under its name (later, if it does not exist yet).
+// ---------------------------------------------------------------------------
+
+// Watched paths by descriptor. inotify never reuses a descriptor, so they
+// keep growing while watches come and go: the table is keyed by hash and
+// holds only the live ones (linear probing, at most half full).
+struct watch_slot {
+    int wd;
+    int named;                  // path was given on the command line
+    char *path;                 // NULL: free slot
+};
+
+static struct watch_slot *watch_table;
+static size_t watch_cap, watch_count;
+static char *watch_lost[WATCH_LOST];   // named paths gone for now
+static int n_watch_lost;
+static volatile sig_atomic_t watch_stop;
+
+static void watch_sigint(int sig)
+{
+    (void)sig;
+    watch_stop = 1;
+}
+
+static size_t watch_home(int wd)
+{
+    return (size_t)fnv1a(FNV_OFFSET, &wd, sizeof(wd)) & (watch_cap - 1);
+}
+
+// Slot of wd, or NULL.
+static struct watch_slot *watch_find(int wd)
+{
+    if (watch_cap == 0) return NULL;
+    for (size_t i = watch_home(wd); watch_table[i].path != NULL; i = (i + 1) & (watch_cap - 1)) {
+        if (watch_table[i].wd == wd) return &watch_table[i];
+    }
+    return NULL;
+}
+
+// Record path for wd unless it is known already. Returns -1 if out of memory.
+static int watch_put(int wd, const char *path, int named)
+{
+    struct watch_slot *w = watch_find(wd);
+    if (w != NULL) {
+        if (named) w->named = 1;
+        return 0;
+    }
+
+    if ((watch_count + 1) * 2 > watch_cap) {
+        size_t cap = watch_cap ? watch_cap * 2 : WATCH_SLOTS;
+        struct watch_slot *t = calloc(cap, sizeof(*t));
+        if (t == NULL) return -1;
+        struct watch_slot *old = watch_table;
+        size_t old_cap = watch_cap;
+        watch_table = t;
+        watch_cap = cap;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].path == NULL) continue;
+            size_t j = watch_home(old[i].wd);
+            while (watch_table[j].path != NULL) j = (j + 1) & (watch_cap - 1);
+            watch_table[j] = old[i];
+        }
+        free(old);
+    }
+
+    char *copy = strdup(path);
+    if (copy == NULL) return -1;
+    size_t i = watch_home(wd);
+    while (watch_table[i].path != NULL) i = (i + 1) & (watch_cap - 1);
+    watch_table[i].wd = wd;
+    watch_table[i].named = named;
+    watch_table[i].path = copy;
+    watch_count++;
+    return 0;
+}
+
+// Remove wd and hand its path (NULL if unknown) to the caller.
+static char *watch_take(int wd, int *named)
+{
+    struct watch_slot *w = watch_find(wd);
+    if (w == NULL) return NULL;
+
+    char *path = w->path;
+    if (named) *named = w->named;
+
+    // backward shift: move up the entries whose probe ran over the hole
+    size_t hole = (size_t)(w - watch_table);
+    for (size_t i = (hole + 1) & (watch_cap - 1); watch_table[i].path != NULL; i = (i + 1) & (watch_cap - 1)) {
+        size_t home = watch_home(watch_table[i].wd);
+        if (((i - home) & (watch_cap - 1)) >= ((i - hole) & (watch_cap - 1))) {
+            watch_table[hole] = watch_table[i];
+            hole = i;
+        }
+    }
+    watch_table[hole].path = NULL;
+    watch_count--;
+    return path;
+}
+
+static void watch_forget(void)
+{
+    for (size_t i = 0; i < watch_cap; i++) free(watch_table[i].path);
+    free(watch_table);
+    watch_table = NULL;
+    watch_cap = watch_count = 0;
+    for (int i = 0; i < n_watch_lost; i++) free(watch_lost[i]);
+    n_watch_lost = 0;
+}
+
+// Watch path, and below it when it is a directory. Returns the number of
+// watches added.
+static int watch_add(int ifd, const char *path, int depth, int named)
+{
+    struct stat st;
+    int wd = inotify_add_watch(ifd, path, WATCH_EVENTS);
+    if (wd < 0) return 0;
+
+    (void)watch_put(wd, path, named);   // unrecorded: its renames and new subdirectories are missed
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) return 1;
+    if (depth >= WATCH_DEPTH) return 1;
+
+    struct dir_listing *d = dir_list(path);
+    int n = 1;
+    if (d == NULL) return n;
+
+    size_t len = strlen(path);
+    for (size_t i = 0; i < d->count; i++) {
+        const char *name = d->names + d->offsets[i];
+        char sub[PATH_MAX];
+
+        if (name[0] == '.') continue;
+        if (d->types[i] != DT_DIR && d->types[i] != DT_UNKNOWN) continue;
+        if (len + strlen(name) + 2 > sizeof(sub)) continue;
+
+        memcpy(sub, path, len);
+        sub[len] = '/';
+        memcpy(sub + len + 1, name, strlen(name) + 1);
+        n += watch_add(ifd, sub, depth + 1, 0);
+    }
+    dir_release(d);
+    return n;
+}
+
+// Watch the lost named paths that exist again. Returns how many came back.
+static int watch_retry(int ifd)
+{
+    int back = 0;
+
+    for (int i = 0; i < n_watch_lost; ) {
+        if (watch_add(ifd, watch_lost[i], 0, 1) > 0) {
+            free(watch_lost[i]);
+            watch_lost[i] = watch_lost[--n_watch_lost];
+            back++;
+        } else {
+            i++;
+        }
+    }
+    return back;
+}
+
+// The inode behind wd is gone or was moved away: watch its path again.
+static void watch_renew(int ifd, int wd, int moved)
+{
+    int named;
+    char *path = watch_take(wd, &named);
+    if (path == NULL) return;
+    if (moved) inotify_rm_watch(ifd, wd);   // it would follow the inode
+
+    // a path below a watched directory comes back through IN_CREATE
+    if (watch_add(ifd, path, 0, named) == 0 && named && n_watch_lost < WATCH_LOST) {
+        watch_lost[n_watch_lost++] = path;
+        return;
+    }
+    free(path);
+}
+
+// Drain the inotify queue. Returns the number of relevant events.
+static int watch_events(int ifd)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changes = 0;
+
+    for (;;) {
+        ssize_t n = read(ifd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                watch_renew(ifd, ev->wd, (ev->mask & IN_MOVE_SELF) != 0);
+                changes++;
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                free(watch_take(ev->wd, NULL));
+                continue;
+            }
+            if (ev->len > 0 && ev->name[0] == '.') continue;   // editor swap files, .git
+            changes++;
+
+            struct watch_slot *w = watch_find(ev->wd);
+            if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && w != NULL) {
+                char sub[PATH_MAX];
+                size_t pos = 0;
+                sub[0] = '\0';
+                append_str(sub, &pos, sizeof(sub), w->path);
+                append_str(sub, &pos, sizeof(sub), "/");
+                append_str(sub, &pos, sizeof(sub), ev->name);
+                watch_add(ifd, sub, 0, 0);
+            }
+        }
+    }
+    return changes + watch_retry(ifd);
+}
+
+static void watch_arm(int tfd, long ms)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    timerfd_settime(tfd, 0, &its, NULL);
+}
+
+// "watch-run [exit:0|12ms]" like the prompt, plus a note.
+static void watch_report(int status, unsigned long long ms, const char *note)
+{
+    char out[PROMPT_SIZE];
+    size_t pos = 0;
+
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "watch-run [");
+    append_status(out, &pos, sizeof(out), status);
+    append_str(out, &pos, sizeof(out), "|");
+    append_num(out, &pos, sizeof(out), ms);
+    append_str(out, &pos, sizeof(out), "ms]");
+    append_str(out, &pos, sizeof(out), note);
+    append_str(out, &pos, sizeof(out), "\n");
+    safe_write(STDERR_FILENO, out);
+}
+
+// SIGTERM the run's process group, SIGKILL it if it lingers, then collect.
+static void watch_cancel(struct launch *l, int pidfd)
+{
+    struct pollfd pfd;
+    int status;
+    unsigned long long ms;
+
+    kill(-l->pid, SIGTERM);
+    pfd.fd = pidfd;
+    pfd.events = POLLIN;
+    if (pidfd < 0 || poll(&pfd, 1, WATCH_KILL_MS) <= 0) kill(-l->pid, SIGKILL);
+    if (launch_finish(l, 0, &status, &ms) == 0) watch_report(status, ms, " cancelled");
+}
+
+static void watch_builtin(char *argv[], int argc)
+{
+    int sep = 1;
+    while (sep < argc && strcmp(argv[sep], "--") != 0) sep++;
+    if (sep + 1 >= argc) {
+        safe_write(STDERR_FILENO, "Error: usage: watch-run [paths...] -- cmd [args...]\n");
+        return;
+    }
+    char **cmdv = argv + sep + 1;
+    int cmdc = argc - sep - 1;
+
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (ifd < 0 || tfd < 0) {
+        safe_write(STDERR_FILENO, "Error: watch-run: inotify unavailable\n");
+        if (ifd >= 0) close(ifd);
+        if (tfd >= 0) close(tfd);
+        return;
+    }
+
+    int watches = 0;
+    for (int i = 1; i < sep; i++) watches += watch_add(ifd, argv[i], 0, 1);
+    if (sep == 1) watches = watch_add(ifd, ".", 0, 1);
+    if (watches == 0) {
+        safe_write(STDERR_FILENO, "Error: watch-run: nothing to watch\n");
+        close(ifd);
+        close(tfd);
+        return;
+    }
+
+    // no SA_RESTART: Ctrl+C must interrupt poll()
+    struct sigaction sa, old;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old);
+    watch_stop = 0;
+
+    struct launch run;
+    int running = 0, pidfd = -1;
+    int pending = 1;   // run once right away
+    watch_arm(tfd, 1);
+
+    while (!watch_stop) {
+        struct pollfd pfds[3];
+        pfds[0].fd = ifd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = tfd;
+        pfds[1].events = POLLIN;
+        pfds[2].fd = pidfd;   // -1: ignored by poll
+        pfds[2].events = POLLIN;
+
+        // a deleted named path is looked for again until it reappears
+        int pr = poll(pfds, 3, n_watch_lost > 0 ? WATCH_RETRY_MS : -1);
+        if (pr < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        // a run that ended in the same wakeup as a change is reported, not cancelled
+        if (running && (pfds[2].revents & POLLIN)) {
+            int status;
+            unsigned long long ms;
+            if (launch_finish(&run, 0, &status, &ms) == 0) watch_report(status, ms, " - waiting for changes");
+            running = 0;
+            close(pidfd);
+            pidfd = -1;
+        }
+
+        if ((pfds[0].revents & POLLIN) || pr == 0) {
+            int n = pr == 0 ? watch_retry(ifd) : watch_events(ifd);
+            if (n > 0) {
+                if (running) {
+                    watch_cancel(&run, pidfd);
+                    running = 0;
+                    if (pidfd >= 0) close(pidfd);
+                    pidfd = -1;
+                }
+                pending += n;
+                watch_arm(tfd, WATCH_DEBOUNCE_MS);   // restart the quiet period
+            }
+        }
+
+        if ((pfds[1].revents & POLLIN) && pending > 0) {
+            unsigned long long expirations;
+            (void)read(tfd, &expirations, sizeof(expirations));
+            pending = 0;
+            if (running) continue;   // cannot happen: changes cancel the run
+            watch_retry(ifd);        // a save may have left a path missing briefly
+
+            if (launch_start(&run, cmdv, cmdc, 1, -1) == 0) {
+                running = 1;
+                pidfd = (int)syscall(SYS_pidfd_open, run.pid, 0);
+                if (pidfd < 0) {   // no pidfd: fall back to a blocking run
+                    int status;
+                    unsigned long long ms;
+                    if (launch_finish(&run, 0, &status, &ms) == 0) watch_report(status, ms, "");
+                    running = 0;
+                }
+            }
+        }
+    }
+
+    if (running) watch_cancel(&run, pidfd);
+    if (pidfd >= 0) close(pidfd);
+    sigaction(SIGINT, &old, NULL);
+    close(ifd);
+    close(tfd);
+    watch_forget();
+    safe_write(STDERR_FILENO, "\nwatch-run: stopped\n");
+}
+
+// ---------------------------------------------------------------------------
+// Result cache ("cache cmd args...")
+//
+// Key   = FNV-1a over argv, cwd, PATH, the variables listed in
+//         ENSEASH_CACHE_ENV (colon separated) and the size/mtime/content
+//         of the "<" input file.
+// Store = <dir>/objects/<hash>  content-addressed blobs (stdout, ">" file)
+//         <dir>/entries/<key>   struct cache_entry pointing at the blobs
+// ---------------------------------------------------------------------------
+
+struct cache_entry {
+    unsigned int magic;
+    int status;
+    unsigned long long ms;
+    unsigned long long stdout_hash;
+    unsigned long long file_hash;
+    int has_file;
+};
+
+// <dir>/<sub>, or just <dir> when sub is NULL.
+static size_t cache_dir(char *dst, const char *sub)
+{
+    const char *dir = getenv("ENSEASH_CACHE_DIR");
+    size_t pos = 0;
+
+    dst[0] = '\0';
+    append_str(dst, &pos, PATH_SIZE, dir ? dir : CACHE_DIR_DEFAULT);
+    if (sub != NULL) {
+        append_str(dst, &pos, PATH_SIZE, "/");
+        append_str(dst, &pos, PATH_SIZE, sub);
+    }
+    return pos;
+}
+
+// <dir>/<sub>/<hash in hex>
+static void cache_path(char *dst, const char *sub, unsigned long long hash)
+{
+    size_t pos = cache_dir(dst, sub);
+    append_str(dst, &pos, PATH_SIZE, "/");
+    append_hex(dst, &pos, PATH_SIZE, hash);
+}
+
+static int cache_init(void)
+{
+    static const char *subs[] = { NULL, "objects", "entries" };
+    char path[PATH_SIZE];
+
+    for (int i = 0; i < 3; i++) {
+        cache_dir(path, subs[i]);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) return -1;
+    }
+    return 0;
+}
+
+// Copy src to dst (either may be -1 to skip), hashing what was read.
+static int copy_fd(int src, int dst, unsigned long long *hash)
+{
+    static char chunk[IO_CHUNK];
+    ssize_t n;
+
+    while ((n = read(src, chunk, sizeof(chunk))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (hash) *hash = fnv1a(*hash, chunk, (size_t)n);
+        for (ssize_t off = 0; dst >= 0 && off < n; ) {
+            ssize_t w = write(dst, chunk + off, (size_t)(n - off));
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            off += w;
+        }
+    }
+    return 0;
+}
+
+static int cache_key(char *argv[], int argc, const char *in, unsigned long long *key)
+{
+    unsigned long long h = FNV_OFFSET;
+    char cwd[PATH_SIZE];
+
+    for (int i = 0; i < argc; i++) h = fnv1a_str(h, argv[i]);
+
+    if (getcwd(cwd, sizeof(cwd)) != NULL) h = fnv1a_str(h, cwd);
+
+    const char *path = env_get("PATH");
+    h = fnv1a_str(h, path ? path : "");
+
+    const char *list = getenv("ENSEASH_CACHE_ENV");
+    if (list != NULL) {
+        char names[BUFFER_SIZE];
+        size_t pos = 0;
+        names[0] = '\0';
+        append_str(names, &pos, sizeof(names), list);
+        for (char *name = strtok(names, ":"); name != NULL; name = strtok(NULL, ":")) {
+            const char *val = env_get(name);
+            h = fnv1a_str(h, name);
+            h = fnv1a_str(h, val ? val : "");
+        }
+    }
+
+    if (in != NULL) {
+        int fd = open(in, O_RDONLY);
+        if (fd < 0) return -1;
+        struct stat st;
+        if (fstat(fd, &st) < 0) { close(fd); return -1; }
+        h = fnv1a(h, &st.st_size, sizeof(st.st_size));
+        h = fnv1a(h, &st.st_mtim, sizeof(st.st_mtim));
+        int r = copy_fd(fd, -1, &h);
+        close(fd);
+        if (r < 0) return -1;
+    }
+
+    *key = h;
+    return 0;
+}
+
+// Move the temporary file tmp into the store under its content hash.
+static void cache_commit_object(const char *tmp, unsigned long long hash)
+{
+    char path[PATH_SIZE];
+    cache_path(path, "objects", hash);
+    if (access(path, F_OK) == 0) unlink(tmp);   // already stored
+    else if (rename(tmp, path) < 0) unlink(tmp);
+}
+
+// Snapshot the ">" output file into the store.
+static int cache_store_file(const char *file, unsigned long long *hash)
+{
+    char tmp[PATH_SIZE];
+    size_t pos;
+
+    cache_path(tmp, "objects", (unsigned long long)getpid());
+    pos = strlen(tmp);
+    append_str(tmp, &pos, sizeof(tmp), ".file");
+
+    int src = open(file, O_RDONLY);
+    if (src < 0) return -1;
+    int dst = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dst < 0) { close(src); return -1; }
+
+    *hash = FNV_OFFSET;
+    int r = copy_fd(src, dst, hash);
+    close(src);
+    close(dst);
+    if (r < 0) { unlink(tmp); return -1; }
+
+    cache_commit_object(tmp, *hash);
+    return 0;
+}
+
+static int cache_replay_object(unsigned long long hash, int dst)
+{
+    char path[PATH_SIZE];
+    cache_path(path, "objects", hash);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    int r = copy_fd(fd, dst, NULL);
+    close(fd);
+    return r;
+}
+
+static int cache_lookup(unsigned long long key, struct cache_entry *e)
+{
+    char path[PATH_SIZE];
+    cache_path(path, "entries", key);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, e, sizeof(*e));
+    close(fd);
+    if (n != (ssize_t)sizeof(*e) || e->magic != CACHE_MAGIC) return -1;
+
+    // a hit is only valid if every referenced blob is still there
+    cache_path(path, "objects", e->stdout_hash);
+    if (access(path, R_OK) < 0) return -1;
+    if (e->has_file) {
+        cache_path(path, "objects", e->file_hash);
+        if (access(path, R_OK) < 0) return -1;
+    }
+    return 0;
+}
+
+static int cache_replay(const struct cache_entry *e, const char *out)
+{
+    if (cache_replay_object(e->stdout_hash, STDOUT_FILENO) < 0) return -1;
+    if (e->has_file && out != NULL) {
+        int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return -1;
+        int r = cache_replay_object(e->file_hash, fd);
+        close(fd);
+        if (r < 0) return -1;
+    }
+    return 0;
+}
+
+// Copies the command's stdout to the terminal and the store object while
+// the shell waits for the command.
+struct cache_tee {
+    int in;                     // read end of the command's stdout pipe
+    int tfd;                    // object being recorded
+    unsigned long long hash;
+    int failed;                 // the object is incomplete, do not store it
+    pthread_t thread;
+};
+
+static void *cache_tee_main(void *arg)
+{
+    struct cache_tee *t = arg;
+    static char chunk[IO_CHUNK];
+    ssize_t n;
+
+    // tee: the terminal still sees output live
+    while ((n = read(t->in, chunk, sizeof(chunk))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            t->failed = 1;
+            break;
+        }
+        t->hash = fnv1a(t->hash, chunk, (size_t)n);
+        (void)write_full(STDOUT_FILENO, chunk, (size_t)n);   // the terminal may be gone
+        if (!t->failed && write_full(t->tfd, chunk, (size_t)n) < 0) t->failed = 1;
+    }
+    close(t->in);
+    return NULL;
+}
+
+// Run the command with stdout teed through a pipe into a store object.
+// It goes through launch_start()/launch_finish() like any other command,
+// with the tee in a thread so the status line keeps running.
+static int cache_record(char *argv[], int argc, unsigned long long key, const char *out,
+                        int *status, unsigned long long *ms)
+{
+    struct cache_entry e;
+    struct cache_tee tee;
+    struct launch l;
+    char tmp[PATH_SIZE];
+    size_t pos;
+    int pfd[2];
+
+    cache_path(tmp, "objects", (unsigned long long)getpid());
+    pos = strlen(tmp);
+    append_str(tmp, &pos, sizeof(tmp), ".out");
+
+    int tfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tfd < 0) return run_command(argv, argc, status, ms);
+    if (pipe2(pfd, O_CLOEXEC) < 0) {
+        close(tfd);
+        unlink(tmp);
+        return run_command(argv, argc, status, ms);
+    }
+
+    int started = launch_start(&l, argv, argc, 0, pfd[1]);
+    close(pfd[1]);
+    if (started < 0) {
+        close(pfd[0]);
+        close(tfd);
+        unlink(tmp);
+        return -1;
+    }
+
+    tee.in = pfd[0];
+    tee.tfd = tfd;
+    tee.hash = FNV_OFFSET;
+    tee.failed = 0;
+    int threaded = pthread_create(&tee.thread, NULL, cache_tee_main, &tee) == 0;
+    if (!threaded) cache_tee_main(&tee);   // no thread: tee first, then wait
+
+    int r = launch_finish(&l, 1, status, ms);
+    if (threaded) pthread_join(tee.thread, NULL);
+    if (close(tfd) < 0) tee.failed = 1;
+    unsigned long long hash = tee.hash;
+
+    if (r < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    // signals are not deterministic results, do not memoize them; nor is a
+    // partial copy of the output (disk full, read error)
+    if (!WIFEXITED(*status) || tee.failed) {
+        unlink(tmp);
+        return 0;
+    }
+
+    cache_commit_object(tmp, hash);
+
+    memset(&e, 0, sizeof(e));
+    e.magic = CACHE_MAGIC;
+    e.status = *status;
+    e.ms = *ms;
+    e.stdout_hash = hash;
+    if (out != NULL) {
+        if (cache_store_file(out, &e.file_hash) < 0) return 0;   // a hit could not restore it
+        e.has_file = 1;
+    }
+
+    char path[PATH_SIZE];
+    char tmp_entry[PATH_SIZE];
+    cache_path(path, "entries", key);
+    pos = 0;
+    tmp_entry[0] = '\0';
+    append_str(tmp_entry, &pos, sizeof(tmp_entry), path);
+    append_str(tmp_entry, &pos, sizeof(tmp_entry), ".tmp");
+
+    int efd = open(tmp_entry, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (efd >= 0) {
+        ssize_t wn = write(efd, &e, sizeof(e));
+        close(efd);
+        if (wn == (ssize_t)sizeof(e)) rename(tmp_entry, path);   // atomic publish
+        else unlink(tmp_entry);
+    }
+    return 0;
+}
+
+// "cache cmd args..." builtin. argv[0] is the command (prefix already removed).
+// Sets *cache to CACHE_HIT/CACHE_MISS, or CACHE_NONE if caching was impossible.
+static int cache_run(char *argv[], int argc, int *status, unsigned long long *ms,
+                     int *cache, unsigned long long *saved_ms)
+{
+    const char *in = find_redirection(argv, argc, "<");
+    const char *out = find_redirection(argv, argc, ">");
+    unsigned long long key;
+    struct cache_entry e;
+
+    *cache = CACHE_NONE;
+    *saved_ms = 0;
+
+    if (cache_init() < 0 || cache_key(argv, argc, in, &key) < 0) {
+        return run_command(argv, argc, status, ms);
+    }
+
+    if (cache_lookup(key, &e) == 0) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int r = cache_replay(&e, out);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        if (r == 0) {
+            *status = e.status;
+            *ms = elapsed_ms(t0, t1);
+            *saved_ms = e.ms > *ms ? e.ms - *ms : 0;
+            *cache = CACHE_HIT;
+            return 0;
+        }
+    }
+
+    *cache = CACHE_MISS;
+    return cache_record(argv, argc, key, out, status, ms);
+}
+
+// ---------------------------------------------------------------------------
+// Persistent history
+//
+// ~/.enseash_history (or $ENSEASH_HISTFILE) is an append-only file of
+// records: struct hist_record followed by the NUL-terminated command, padded
+// to 8 bytes. Readers mmap it and keep an in-memory index of record offsets,
+// extended incrementally when other sessions append. Appends are a single
+// write() under flock(LOCK_EX); scans hold LOCK_SH.
+// ---------------------------------------------------------------------------
+
+struct hist_record {
+    unsigned int magic;
+    unsigned int len;           // command length, without NUL
+    int status;                 // raw waitpid status
+    unsigned int reserved;
+    unsigned long long ms;
+    long long when;             // time(NULL) at the end of the command
+};
+
+static int hist_fd = -1;
+static const char *hist_map;
+static size_t hist_map_len;
+static size_t hist_scanned;     // file offset up to which records are indexed
+static size_t *hist_index;
+static size_t hist_count, hist_cap;
+
+static size_t hist_record_size(unsigned int len)
+{
+    return sizeof(struct hist_record) + ((len + 1 + 7) & ~(size_t)7);
+}
+
+static void hist_open(void)
+{
+    char path[PATH_SIZE];
+    size_t pos = 0;
+    const char *file = getenv("ENSEASH_HISTFILE");
+
+    path[0] = '\0';
+    if (file != NULL) {
+        append_str(path, &pos, sizeof(path), file);
+    } else {
+        const char *home = getenv("HOME");
+        if (home == NULL) return;
+        append_str(path, &pos, sizeof(path), home);
+        append_str(path, &pos, sizeof(path), "/" HIST_FILE_DEFAULT);
+    }
+
+    hist_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+}
+
+// Index records appended since the last scan. Caller holds the flock.
+static void hist_scan(void)
+{
+    struct stat st;
+
+    if (hist_fd < 0 || fstat(hist_fd, &st) < 0) return;
+    size_t size = (size_t)st.st_size;
+
+    if (size < hist_scanned) {  // file was truncated or replaced: start over
+        hist_count = 0;
+        hist_scanned = 0;
+    }
+    if (size > hist_map_len) {
+        if (hist_map != NULL) munmap((void *)hist_map, hist_map_len);
+        void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, hist_fd, 0);
+        hist_map = (m == MAP_FAILED) ? NULL : m;
+        hist_map_len = (m == MAP_FAILED) ? 0 : size;
+    }
+    if (hist_map == NULL) return;
+
+    size_t off = hist_scanned;
+    while (off + sizeof(struct hist_record) <= size) {
+        const struct hist_record *r = (const struct hist_record *)(hist_map + off);
+
+        if (r->magic != HIST_MAGIC || r->len >= BUFFER_SIZE) {
+            off += 8;   // garbage: resynchronise on the next aligned record
+            continue;
+        }
+        if (off + hist_record_size(r->len) > size) break;   // torn tail
+
+        if (hist_count == hist_cap) {
+            size_t cap = hist_cap ? hist_cap * 2 : 256;
+            size_t *idx = realloc(hist_index, cap * sizeof(size_t));
+            if (idx == NULL) break;
+            hist_index = idx;
+            hist_cap = cap;
+        }
+        hist_index[hist_count++] = off;
+        off += hist_record_size(r->len);
+    }
+    hist_scanned = off;
+}
+
+static void hist_sync(void)
+{
+    if (hist_fd < 0) return;
+    flock(hist_fd, LOCK_SH);
+    hist_scan();
+    flock(hist_fd, LOCK_UN);
+}
+
+static const struct hist_record *hist_get(size_t i)
+{
+    return (const struct hist_record *)(hist_map + hist_index[i]);
+}
+
+static const char *hist_cmd(const struct hist_record *r)
+{
+    return (const char *)(r + 1);
+}
+
+static void hist_add(const char *line, int status, unsigned long long ms)
+{
+    char rec[sizeof(struct hist_record) + BUFFER_SIZE + 8];
+    struct hist_record *r = (struct hist_record *)rec;
+    size_t len = strlen(line);
+
+    if (hist_fd < 0 || len >= BUFFER_SIZE) return;
+
+    size_t total = hist_record_size((unsigned int)len);
+    memset(rec, 0, total);
+    r->magic = HIST_MAGIC;
+    r->len = (unsigned int)len;
+    r->status = status;
+    r->ms = ms;
+    r->when = (long long)time(NULL);
+    memcpy(rec + sizeof(*r), line, len);
+
+    flock(hist_fd, LOCK_EX);
+    hist_scan();
+    struct stat st;
+    if (fstat(hist_fd, &st) == 0 && (size_t)st.st_size > hist_scanned) {
+        // a session died mid-write: drop its partial record
+        (void)ftruncate(hist_fd, (off_t)hist_scanned);
+    }
+    (void)write(hist_fd, rec, total);
+    flock(hist_fd, LOCK_UN);
+}
+
+static void hist_print_entry(size_t i)
+{
+    const struct hist_record *r = hist_get(i);
+    char out[BUFFER_SIZE + 64];
+    size_t pos = 0;
+
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "  ");
+    append_num(out, &pos, sizeof(out), (unsigned long long)(i + 1));
+    append_str(out, &pos, sizeof(out), "  [");
+    append_status(out, &pos, sizeof(out), r->status);
+    append_str(out, &pos, sizeof(out), "|");
+    append_num(out, &pos, sizeof(out), r->ms);
+    append_str(out, &pos, sizeof(out), "ms]  ");
+    append_str(out, &pos, sizeof(out), hist_cmd(r));
+    append_str(out, &pos, sizeof(out), "\n");
+    safe_write(STDOUT_FILENO, out);
+}
+
+static unsigned long long parse_num(const char *s, unsigned long long def)
+{
+    unsigned long long v = 0;
+    if (s == NULL || *s == '\0') return def;
+    for (; *s; s++) {
+        if (*s < '0' || *s > '9') return def;
+        v = v * 10 + (unsigned long long)(*s - '0');
+    }
+    return v;
+}
+
+static int cmp_slowest(const void *a, const void *b)
+{
+    const struct hist_record *ra = (const struct hist_record *)(hist_map + *(const size_t *)a);
+    const struct hist_record *rb = (const struct hist_record *)(hist_map + *(const size_t *)b);
+    return (ra->ms < rb->ms) - (ra->ms > rb->ms);
+}
+
+// history [N]                  last N entries (all by default)
+// history --slow [N] [DAYS]    N slowest commands of the last DAYS days
+static int hist_builtin(char *argv[], int argc)
+{
+    if (hist_fd < 0) {
+        safe_write(STDERR_FILENO, "Error: history file unavailable\n");
+        return 1;
+    }
+    hist_sync();
+
+    if (argc >= 2 && strcmp(argv[1], "--slow") == 0) {
+        size_t n = (size_t)parse_num(argc >= 3 ? argv[2] : NULL, 10);
+        long long days = (long long)parse_num(argc >= 4 ? argv[3] : NULL, 7);
+        long long since = (long long)time(NULL) - days * 86400;
+
+        size_t *sel = malloc((hist_count + 1) * sizeof(size_t));
+        if (sel == NULL) return 1;
+        size_t k = 0;
+        for (size_t i = 0; i < hist_count; i++) {
+            if (hist_get(i)->when >= since) sel[k++] = hist_index[i];
+        }
+        qsort(sel, k, sizeof(size_t), cmp_slowest);
+
+        for (size_t j = 0; j < k && j < n; j++) {
+            // map the offset back to its entry number
+            size_t lo = 0, hi = hist_count;
+            while (lo + 1 < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (hist_index[mid] <= sel[j]) lo = mid; else hi = mid;
+            }
+            hist_print_entry(lo);
+        }
+        free(sel);
+        return 0;
+    }
+
+    size_t n = (size_t)parse_num(argc >= 2 ? argv[1] : NULL, hist_count);
+    size_t first = n < hist_count ? hist_count - n : 0;
+    for (size_t i = first; i < hist_count; i++) hist_print_entry(i);
+    return 0;
+}
+
+// Replace a whole-line "!!", "!n" or "!-n" by the matching history entry.
+// Returns 1 if the line was expanded, 0 if untouched, -1 if no such event.
+static int hist_expand(char *line, size_t size)
+{
+    if (line[0] != '!' || line[1] == '\0') return 0;
+
+    hist_sync();
+
+    size_t i;
+    if (strcmp(line, "!!") == 0) {
+        if (hist_count == 0) return -1;
+        i = hist_count - 1;
+    } else if (line[1] == '-') {
+        unsigned long long back = parse_num(line + 2, 0);
+        if (back == 0 || back > hist_count) return -1;
+        i = hist_count - (size_t)back;
+    } else {
+        unsigned long long num = parse_num(line + 1, 0);
+        if (num == 0 || num > hist_count) return -1;
+        i = (size_t)num - 1;
+    }
+
+    size_t pos = 0;
+    line[0] = '\0';
+    append_str(line, &pos, size, hist_cmd(hist_get(i)));
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Session statistics
+//
+// Wall and CPU time of every command, in microseconds, go into per-command
+// log-linear histograms (HDR style): values below 64 get their own bucket,
+// above that each power of two is split into 32 linear sub-buckets, so any
+// recorded value is within ~3% of its bucket bound.
+// ---------------------------------------------------------------------------
+
+struct histogram {
+    unsigned int counts[HIST_BUCKETS];
+    unsigned long long total;
+    unsigned long long max;
+};
+
+struct cmd_stats {
+    char name[STATS_NAME_SIZE];
+    unsigned long long count;
+    struct histogram wall;
+    struct histogram cpu;
+};
+
+static struct cmd_stats **stats;
+static int n_stats, stats_cap;
+static int stats_slots[STATS_SLOTS];   // open addressing: index + 1, 0 = empty
+
+static int hist_bucket(unsigned long long v)
+{
+    if (v < 64) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - 5;
+    return shift * 32 + (int)(v >> shift);
+}
+
+// Highest value that falls into bucket idx.
+static unsigned long long hist_bucket_top(int idx)
+{
+    if (idx < 64) return (unsigned long long)idx;
+    int shift = idx / 32 - 1;
+    unsigned long long m = (unsigned long long)(idx % 32 + 32);
+    return ((m + 1) << shift) - 1;
+}
+
+static void histogram_record(struct histogram *h, unsigned long long v)
+{
+    h->counts[hist_bucket(v)]++;
+    h->total += v;
+    if (v > h->max) h->max = v;
+}
+
+static unsigned long long histogram_percentile(const struct histogram *h, unsigned long long count,
+                                               unsigned int pct)
+{
+    unsigned long long want = (count * pct + 99) / 100;
+    unsigned long long seen = 0;
+
+    if (want == 0) want = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) {
+            unsigned long long top = hist_bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+static struct cmd_stats *stats_find(const char *full)
+{
+    // rows store at most STATS_NAME_SIZE - 1 bytes: look up the same key
+    char name[STATS_NAME_SIZE];
+    size_t npos = 0;
+    name[0] = '\0';
+    append_str(name, &npos, sizeof(name), full);
+
+    unsigned long long h = fnv1a_str(FNV_OFFSET, name);
+    unsigned int slot = (unsigned int)(h % STATS_SLOTS);
+
+    for (int probe = 0; probe < STATS_SLOTS; probe++) {
+        int idx = stats_slots[slot];
+        if (idx == 0) break;
+        if (strcmp(stats[idx - 1]->name, name) == 0) return stats[idx - 1];
+        slot = (slot + 1) % STATS_SLOTS;
+    }
+
+    if (stats_slots[slot] != 0 || n_stats + 1 >= STATS_SLOTS) return NULL;   // table full
+
+    if (n_stats == stats_cap) {
+        int cap = stats_cap ? stats_cap * 2 : 16;
+        struct cmd_stats **v = realloc(stats, (size_t)cap * sizeof(*v));
+        if (v == NULL) return NULL;
+        stats = v;
+        stats_cap = cap;
+    }
+    struct cmd_stats *cs = calloc(1, sizeof(*cs));
+    if (cs == NULL) return NULL;
+
+    size_t pos = 0;
+    append_str(cs->name, &pos, sizeof(cs->name), name);
+    stats[n_stats++] = cs;
+    stats_slots[slot] = n_stats;
+    return cs;
+}
+
+static void stats_record(const char *name, unsigned long long wall_us, unsigned long long cpu_us)
+{
+    struct cmd_stats *cs = stats_find(name);
+    if (cs == NULL) return;
+    cs->count++;
+    histogram_record(&cs->wall, wall_us);
+    histogram_record(&cs->cpu, cpu_us);
+}
+
+static void append_pad(char *dst, size_t *pos, size_t max, size_t col)
+{
+    do {
+        append_str(dst, pos, max, " ");
+    } while (*pos < col && *pos + 1 < max);
+}
+
+static void stats_print_row(int fd, const char *label, const struct histogram *h, unsigned long long count)
+{
+    static const unsigned int pcts[] = { 50, 90, 99 };
+    char out[256];
+    size_t pos = 0;
+
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "  ");
+    append_str(out, &pos, sizeof(out), label);
+    for (int i = 0; i < 3; i++) {
+        append_pad(out, &pos, sizeof(out), 8 + (size_t)i * 13);
+        append_us(out, &pos, sizeof(out), histogram_percentile(h, count, pcts[i]));
+    }
+    append_pad(out, &pos, sizeof(out), 47);
+    append_us(out, &pos, sizeof(out), h->max);
+    append_pad(out, &pos, sizeof(out), 60);
+    append_us(out, &pos, sizeof(out), h->total);
+    append_str(out, &pos, sizeof(out), "\n");
+    safe_write(fd, out);
+}
+
+static int cmp_stats_total(const void *a, const void *b)
+{
+    const struct cmd_stats *sa = *(struct cmd_stats *const *)a;
+    const struct cmd_stats *sb = *(struct cmd_stats *const *)b;
+    return (sa->wall.total < sb->wall.total) - (sa->wall.total > sb->wall.total);
+}
+
+// Commands sorted by total wall time, one wall and one cpu row each.
+static void stats_print(int fd)
+{
+    char out[256];
+    size_t pos = 0;
+
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "command");
+    append_pad(out, &pos, sizeof(out), 8);
+    append_str(out, &pos, sizeof(out), "p50");
+    append_pad(out, &pos, sizeof(out), 21);
+    append_str(out, &pos, sizeof(out), "p90");
+    append_pad(out, &pos, sizeof(out), 34);
+    append_str(out, &pos, sizeof(out), "p99");
+    append_pad(out, &pos, sizeof(out), 47);
+    append_str(out, &pos, sizeof(out), "max");
+    append_pad(out, &pos, sizeof(out), 60);
+    append_str(out, &pos, sizeof(out), "total\n");
+    safe_write(fd, out);
+
+    qsort(stats, (size_t)n_stats, sizeof(*stats), cmp_stats_total);
+    // sorting moved the entries: rebuild the hash index
+    memset(stats_slots, 0, sizeof(stats_slots));
+    for (int i = 0; i < n_stats; i++) {
+        unsigned int slot = (unsigned int)(fnv1a_str(FNV_OFFSET, stats[i]->name) % STATS_SLOTS);
+        while (stats_slots[slot] != 0) slot = (slot + 1) % STATS_SLOTS;
+        stats_slots[slot] = i + 1;
+    }
+
+    for (int i = 0; i < n_stats; i++) {
+        pos = 0;
+        out[0] = '\0';
+        append_str(out, &pos, sizeof(out), stats[i]->name);
+        append_str(out, &pos, sizeof(out), " (");
+        append_num(out, &pos, sizeof(out), stats[i]->count);
+        append_str(out, &pos, sizeof(out), stats[i]->count > 1 ? " runs)\n" : " run)\n");
+        safe_write(fd, out);
+        stats_print_row(fd, "wall", &stats[i]->wall, stats[i]->count);
+        stats_print_row(fd, "cpu", &stats[i]->cpu, stats[i]->count);
+    }
+}
+
+static int stats_dump(const char *file)
+{
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        safe_write(STDERR_FILENO, "Error: cannot open stats file\n");
+        return 1;
+    }
+    stats_print(fd);
+    close(fd);
+    return 0;
+}
+
+// stats                 print the table
+// stats --dump FILE     write it to FILE
+// stats --reset         forget everything
+static int stats_builtin(char *argv[], int argc)
+{
+    if (argc >= 2 && strcmp(argv[1], "--dump") == 0) {
+        if (argc < 3) {
+            safe_write(STDERR_FILENO, "Error: usage: stats --dump FILE\n");
+            return 1;
+        }
+        return stats_dump(argv[2]);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--reset") == 0) {
+        for (int i = 0; i < n_stats; i++) free(stats[i]);
+        n_stats = 0;
+        memset(stats_slots, 0, sizeof(stats_slots));
+        return 0;
+    }
+    stats_print(STDOUT_FILENO);
+    return 0;
+}
+
+static unsigned long long children_cpu_us(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_CHILDREN, &ru) < 0) return 0;
+    return (unsigned long long)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL
+         + (unsigned long long)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+// ---------------------------------------------------------------------------
+// Server mode (enseash --serve SOCKET [--jobs N])
+//
+// One poll() loop serves every client. A client sends FRAME_CMD frames; each
+// command goes through parse_args / expand_globs / exec_child like in the
+// REPL, with at most N commands running at once (the rest wait in a FIFO).
+// stdout and stderr are streamed back as FRAME_STDOUT / FRAME_STDERR, then
+// FRAME_EXIT carries the wait status and timing. Child exit is watched
+// through a pidfd so the loop never blocks in waitpid.
+//
+// Frames are a struct frame_header followed by len bytes, in host byte order
+// (the socket is local). enseash_load.c speaks the same protocol.
+// ---------------------------------------------------------------------------
+
+enum frame_type { FRAME_CMD = 1, FRAME_STDOUT, FRAME_STDERR, FRAME_EXIT };
+
+struct frame_header {
+    unsigned char type;
+    unsigned char reserved[3];
+    unsigned int len;
+};
+
+struct frame_exit {
+    int status;
+    unsigned int reserved;
+    unsigned long long wall_us;
+    unsigned long long cpu_us;
+};
+
+enum client_state { CL_IDLE, CL_QUEUED, CL_RUNNING };
+
+struct client {
+    int fd;                     // -1: free slot
+    int state;
+    char in[sizeof(struct frame_header) + BUFFER_SIZE];
+    size_t in_len;
+    char cmd[BUFFER_SIZE];
+    char *out;                  // frames waiting to be sent
+    size_t out_len, out_off, out_cap;
+    pid_t pid;
+    int pidfd, out_fd, err_fd;
+    int exited;
+    int status;
+    struct rusage ru;
+    struct timespec t0;
+};
+
+static struct client clients[SERVE_MAX_CLIENTS];
+static int serve_queue[SERVE_MAX_CLIENTS];
+static int queue_head, queue_len;
+static int serve_running;
+
+static int client_frame(struct client *c, int type, const void *data, size_t len)
+{
+    struct frame_header h;
+    size_t need = c->out_len + sizeof(h) + len;
+
+    if (need > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : IO_CHUNK;
+        while (cap < need) cap *= 2;
+        char *p = realloc(c->out, cap);
+        if (p == NULL) return -1;
+        c->out = p;
+        c->out_cap = cap;
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.type = (unsigned char)type;
+    h.len = (unsigned int)len;
+    memcpy(c->out + c->out_len, &h, sizeof(h));
+    memcpy(c->out + c->out_len + sizeof(h), data, len);
+    c->out_len = need;
+    return 0;
+}
+
+static void client_reap(struct client *c)
+{
+    if (c->pidfd >= 0) { close(c->pidfd); c->pidfd = -1; }
+    if (c->out_fd >= 0) { close(c->out_fd); c->out_fd = -1; }
+    if (c->err_fd >= 0) { close(c->err_fd); c->err_fd = -1; }
+}
+
+static void client_close(struct client *c)
+{
+    if (c->state == CL_RUNNING) {
+        if (!c->exited) {
+            kill(c->pid, SIGKILL);
+            while (waitpid(c->pid, NULL, 0) < 0 && errno == EINTR) { }
+        }
+        serve_running--;
+    } else if (c->state == CL_QUEUED) {
+        // drop it from the queue
+        int idx = (int)(c - clients);
+        for (int i = 0, k = 0; i < queue_len; i++) {
+            int v = serve_queue[(queue_head + i) % SERVE_MAX_CLIENTS];
+            if (v != idx) serve_queue[(queue_head + k++) % SERVE_MAX_CLIENTS] = v;
+        }
+        queue_len--;
+    }
+    client_reap(c);
+    close(c->fd);
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+// Send the exit frame and go back to accepting commands.
+static void client_finish(struct client *c, int status, unsigned long long wall_us, unsigned long long cpu_us)
+{
+    struct frame_exit e;
+
+    memset(&e, 0, sizeof(e));
+    e.status = status;
+    e.wall_us = wall_us;
+    e.cpu_us = cpu_us;
+    client_frame(c, FRAME_EXIT, &e, sizeof(e));
+    c->state = CL_IDLE;
+}
+
+// Take the next complete FRAME_CMD out of the input buffer, if any.
+// Returns -1 on a protocol error.
+static int client_parse(struct client *c)
+{
+    struct frame_header h;
+
+    if (c->state != CL_IDLE || c->in_len < sizeof(h)) return 0;
+    memcpy(&h, c->in, sizeof(h));
+    if (h.type != FRAME_CMD || h.len >= BUFFER_SIZE) return -1;
+    if (c->in_len < sizeof(h) + h.len) return 0;
+
+    memcpy(c->cmd, c->in + sizeof(h), h.len);
+    c->cmd[h.len] = '\0';
+    c->in_len -= sizeof(h) + h.len;
+    memmove(c->in, c->in + sizeof(h) + h.len, c->in_len);
+
+    c->state = CL_QUEUED;
+    serve_queue[(queue_head + queue_len++) % SERVE_MAX_CLIENTS] = (int)(c - clients);
+    return 0;
+}
+
+static void client_launch(struct client *c)
+{
+    char line[BUFFER_SIZE];
+    char *argv[MAX_ARGS];
+    struct arg_list args = { 0 };
+    int pout[2], perr[2];
+
+    memcpy(line, c->cmd, sizeof(line));
+    strip_eol(line);
+    trim_spaces(line);
+
+    int argc = parse_args(line, argv, MAX_ARGS);
+    if (argc == 0) {
+        client_finish(c, 0, 0, 0);
+        return;
+    }
+    if (expand_globs(argv, argc, &args) < 0 || pipe2(pout, O_CLOEXEC) < 0) {
+        arg_free(&args);
+        client_finish(c, EXIT_FAILURE << 8, 0, 0);
+        return;
+    }
+    if (pipe2(perr, O_CLOEXEC) < 0) {
+        close(pout[0]);
+        close(pout[1]);
+        arg_free(&args);
+        client_finish(c, EXIT_FAILURE << 8, 0, 0);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &c->t0);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (null >= 0) dup2(null, STDIN_FILENO);
+        dup2(pout[1], STDOUT_FILENO);
+        dup2(perr[1], STDERR_FILENO);
+        exec_child(args.v, args.argc);
+    }
+
+    arg_free(&args);
+    close(pout[1]);
+    close(perr[1]);
+
+    if (pid < 0) {
+        close(pout[0]);
+        close(perr[0]);
+        client_finish(c, EXIT_FAILURE << 8, 0, 0);
+        return;
+    }
+
+    fcntl(pout[0], F_SETFL, O_NONBLOCK);
+    fcntl(perr[0], F_SETFL, O_NONBLOCK);
+    c->pid = pid;
+    c->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    c->out_fd = pout[0];
+    c->err_fd = perr[0];
+    c->exited = 0;
+    c->state = CL_RUNNING;
+    serve_running++;
+}
+
+// Move one chunk of child output into the client's frame buffer.
+static void client_relay(struct client *c, int *fd, int type)
+{
+    static char chunk[IO_CHUNK];
+    ssize_t n = read(*fd, chunk, sizeof(chunk));
+
+    if (n > 0) {
+        client_frame(c, type, chunk, (size_t)n);
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+static void client_check_done(struct client *c)
+{
+    if (c->state != CL_RUNNING || !c->exited || c->out_fd >= 0 || c->err_fd >= 0) return;
+
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    unsigned long long cpu_us =
+        (unsigned long long)(c->ru.ru_utime.tv_sec + c->ru.ru_stime.tv_sec) * 1000000ULL
+        + (unsigned long long)(c->ru.ru_utime.tv_usec + c->ru.ru_stime.tv_usec);
+
+    client_reap(c);
+    serve_running--;
+    client_finish(c, c->status, elapsed_us(c->t0, t1), cpu_us);
+}
+
+static int serve_listen(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        safe_write(STDERR_FILENO, "Error: socket path too long\n");
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    unlink(path);   // stale socket from a previous run
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int serve(const char *path, int jobs)
+{
+    static struct pollfd pfds[1 + 4 * SERVE_MAX_CLIENTS];
+    static int owner[1 + 4 * SERVE_MAX_CLIENTS];   // client index per pollfd
+
+    int lfd = serve_listen(path);
+    if (lfd < 0) {
+        safe_write(STDERR_FILENO, "Error: cannot listen on socket\n");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++) clients[i].fd = -1;
+
+    char msg[PATH_SIZE + 64];
+    size_t pos = 0;
+    msg[0] = '\0';
+    append_str(msg, &pos, sizeof(msg), "enseash: serving on ");
+    append_str(msg, &pos, sizeof(msg), path);
+    append_str(msg, &pos, sizeof(msg), " (jobs ");
+    append_num(msg, &pos, sizeof(msg), (unsigned long long)jobs);
+    append_str(msg, &pos, sizeof(msg), ")\n");
+    safe_write(STDOUT_FILENO, msg);
+
+    for (;;) {
+        while (serve_running < jobs && queue_len > 0) {
+            int idx = serve_queue[queue_head];
+            queue_head = (queue_head + 1) % SERVE_MAX_CLIENTS;
+            queue_len--;
+            client_launch(&clients[idx]);
+        }
+
+        int n = 0;
+        int need_tick = 0;
+        pfds[n].fd = lfd;
+        pfds[n].events = POLLIN;
+        owner[n++] = -1;
+
+        for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+            struct client *c = &clients[i];
+            if (c->fd < 0) continue;
+
+            short ev = 0;
+            if (c->state == CL_IDLE) ev |= POLLIN;
+            if (c->out_off < c->out_len) ev |= POLLOUT;
+            pfds[n].fd = c->fd;
+            pfds[n].events = ev;
+            owner[n++] = i;
+
+            if (c->state != CL_RUNNING) continue;
+            // backpressure: stop reading the child while the client lags
+            int room = c->out_len - c->out_off < SERVE_HIGH_WATER;
+            if (c->out_fd >= 0 && room) {
+                pfds[n].fd = c->out_fd;
+                pfds[n].events = POLLIN;
+                owner[n++] = i;
+            }
+            if (c->err_fd >= 0 && room) {
+                pfds[n].fd = c->err_fd;
+                pfds[n].events = POLLIN;
+                owner[n++] = i;
+            }
+            if (!c->exited && c->pidfd >= 0) {
+                pfds[n].fd = c->pidfd;
+                pfds[n].events = POLLIN;
+                owner[n++] = i;
+            } else if (!c->exited) {
+                need_tick = 1;
+            }
+        }
+
+        // without a pidfd (old kernel) fall back to polling for exits
+        int r = poll(pfds, (nfds_t)n, need_tick ? 100 : -1);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int cfd;
+            while ((cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+                int slot = -1;
+                for (int i = 0; i < SERVE_MAX_CLIENTS && slot < 0; i++) {
+                    if (clients[i].fd < 0) slot = i;
+                }
+                if (slot < 0) {
+                    close(cfd);
+                    break;
+                }
+                memset(&clients[slot], 0, sizeof(clients[slot]));
+                clients[slot].fd = cfd;
+                clients[slot].pidfd = clients[slot].out_fd = clients[slot].err_fd = -1;
+            }
+        }
+
+        for (int k = 1; k < n; k++) {
+            struct client *c = &clients[owner[k]];
+            short rev = pfds[k].revents;
+            if (rev == 0 || c->fd < 0) continue;
+
+            if (pfds[k].fd == c->fd) {
+                if (rev & POLLOUT) {
+                    ssize_t w = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+                    if (w > 0) c->out_off += (size_t)w;
+                    if (c->out_off == c->out_len) c->out_off = c->out_len = 0;
+                    if (w < 0 && errno != EAGAIN && errno != EINTR) {
+                        client_close(c);
+                        continue;
+                    }
+                }
+                if (rev & (POLLIN | POLLHUP | POLLERR)) {
+                    ssize_t rd = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+                    if (rd == 0 || (rd < 0 && errno != EAGAIN && errno != EINTR)) {
+                        client_close(c);
+                        continue;
+                    }
+                    if (rd > 0) c->in_len += (size_t)rd;
+                    if (client_parse(c) < 0) client_close(c);
+                }
+            } else if (pfds[k].fd == c->out_fd) {
+                client_relay(c, &c->out_fd, FRAME_STDOUT);
+            } else if (pfds[k].fd == c->err_fd) {
+                client_relay(c, &c->err_fd, FRAME_STDERR);
+            } else if (pfds[k].fd == c->pidfd) {
+                if (wait4(c->pid, &c->status, WNOHANG, &c->ru) == c->pid) c->exited = 1;
+            }
+        }
+
+        for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+            struct client *c = &clients[i];
+            if (c->fd < 0) continue;
+            if (c->state == CL_RUNNING && !c->exited && c->pidfd < 0
+                && wait4(c->pid, &c->status, WNOHANG, &c->ru) == c->pid) {
+                c->exited = 1;
+            }
+            client_check_done(c);
+            if (client_parse(c) < 0) client_close(c);
+        }
+    }
+
+    close(lfd);
+    unlink(path);
+    return EXIT_FAILURE;
+}
+
+// ---------------------------------------------------------------------------
+// Speculative prefetch (ENSEASH_PREFETCH=1)
+//
+// As soon as the next command name is known (the following line already
+// buffered in batch mode, or a completed first word at the terminal), a
+// worker thread resolves it through PATH and asks the kernel to read ahead
+// the executable, its ELF interpreter and the shared libraries it needs
+// (DT_NEEDED, recursively). By the time execvp() runs, the pages the loader
+// touches are already in the page cache. The shell never waits for it:
+// requests go through a small queue whose oldest entry is dropped when full.
+// ---------------------------------------------------------------------------
+
+static const char *lib_dirs[] = {
+    "/lib/x86_64-linux-gnu", "/usr/lib/x86_64-linux-gnu",
+    "/lib/aarch64-linux-gnu", "/usr/lib/aarch64-linux-gnu",
+    "/lib64", "/usr/lib64", "/lib", "/usr/lib", "/usr/local/lib"
+};
+
+// The search lists are copied on the main thread: the worker must not call
+// getenv() while export/unset may be changing environ.
+struct prefetch_req {
+    char name[PATH_SIZE];
+    char path[PREFETCH_ENV_SIZE];      // PATH
+    char lib_path[PREFETCH_ENV_SIZE];  // LD_LIBRARY_PATH, "" if unset
+};
+
+struct prefetch_job {
+    char files[PREFETCH_MAX_FILES][PATH_SIZE];   // already read ahead
+    int nfiles;
+    unsigned long long bytes;
+    const char *lib_path;
+};
+
+static int prefetch_on = -1;
+static int prefetch_started;
+static pthread_t prefetch_thread;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static struct prefetch_req prefetch_queue[PREFETCH_QUEUE];
+static int prefetch_head, prefetch_count;
+static struct prefetch_job prefetch_cur;
+
+// totals for the ENSEASH_PHASES file, under prefetch_lock
+static unsigned long long prefetch_reqs, prefetch_files, prefetch_bytes, prefetch_ns;
+
+static int prefetch_enabled(void)
+{
+    if (prefetch_on < 0) {
+        const char *v = getenv("ENSEASH_PREFETCH");
+        prefetch_on = v != NULL && strcmp(v, "0") != 0;
+    }
+    return prefetch_on;
+}
+
+// File offset of a virtual address, through the PT_LOAD segments.
+static size_t elf_offset(const Elf64_Phdr *ph, int n, Elf64_Addr addr)
+{
+    for (int i = 0; i < n; i++) {
+        if (ph[i].p_type == PT_LOAD && addr >= ph[i].p_vaddr && addr < ph[i].p_vaddr + ph[i].p_filesz) {
+            return (size_t)(addr - ph[i].p_vaddr + ph[i].p_offset);
+        }
+    }
+    return (size_t)-1;
+}
+
+static int prefetch_file(struct prefetch_job *job, const char *path);
+
+// Try dir/name, dir being the first dlen bytes. Returns 0 if it was found.
+static int prefetch_lib_at(struct prefetch_job *job, const char *dir, size_t dlen, const char *name)
+{
+    char path[PATH_SIZE];
+
+    // $ORIGIN and friends are not expanded: the loader will find those
+    if (dlen == 0 || dlen + strlen(name) + 2 > sizeof(path) || memchr(dir, '$', dlen)) return -1;
+
+    memcpy(path, dir, dlen);
+    path[dlen] = '/';
+    memcpy(path + dlen + 1, name, strlen(name) + 1);
+    return prefetch_file(job, path) >= 0 ? 0 : -1;
+}
+
+// Try dir/name for each directory of a ':' separated list.
+static int prefetch_lib_in(struct prefetch_job *job, const char *list, const char *name)
+{
+    while (list != NULL) {
+        const char *end = strchr(list, ':');
+        size_t dlen = end ? (size_t)(end - list) : strlen(list);
+        if (prefetch_lib_at(job, list, dlen, name) == 0) return 0;
+        list = end ? end + 1 : NULL;
+    }
+    return -1;
+}
+
+// Search in ld.so order: DT_RPATH (only without DT_RUNPATH),
+// LD_LIBRARY_PATH, DT_RUNPATH, then the default directories.
+static void prefetch_lib(struct prefetch_job *job, const char *rpath, const char *runpath,
+                         const char *name)
+{
+    if (strchr(name, '/') != NULL) {
+        (void)prefetch_file(job, name);
+        return;
+    }
+    if (runpath == NULL && prefetch_lib_in(job, rpath, name) == 0) return;
+    if (job->lib_path[0] != '\0' && prefetch_lib_in(job, job->lib_path, name) == 0) return;
+    if (prefetch_lib_in(job, runpath, name) == 0) return;
+    for (size_t i = 0; i < sizeof(lib_dirs) / sizeof(lib_dirs[0]); i++) {
+        if (prefetch_lib_at(job, lib_dirs[i], strlen(lib_dirs[i]), name) == 0) return;
+    }
+}
+
+// Read ahead an ELF file and, for a 64-bit one, its interpreter and its
+// DT_NEEDED libraries. Returns -1 if path cannot be opened.
+static int prefetch_file(struct prefetch_job *job, const char *path)
+{
+    for (int i = 0; i < job->nfiles; i++) {
+        if (strcmp(job->files[i], path) == 0) return 0;
+    }
+    if (job->nfiles == PREFETCH_MAX_FILES || strlen(path) >= PATH_SIZE) return 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    memcpy(job->files[job->nfiles++], path, strlen(path) + 1);
+    job->bytes += (unsigned long long)st.st_size;
+    if (readahead(fd, 0, (size_t)st.st_size) < 0) {
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+
+    size_t size = (size_t)st.st_size;
+    unsigned char *map = size >= sizeof(Elf64_Ehdr) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    const Elf64_Ehdr *eh = (const Elf64_Ehdr *)map;
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS64
+        || eh->e_phentsize != sizeof(Elf64_Phdr) || eh->e_phoff > size
+        || (size - eh->e_phoff) / sizeof(Elf64_Phdr) < eh->e_phnum) {
+        munmap(map, size);
+        return 0;
+    }
+
+    const Elf64_Phdr *ph = (const Elf64_Phdr *)(map + eh->e_phoff);
+    int nph = eh->e_phnum;
+    const Elf64_Dyn *dyn = NULL;
+    size_t ndyn = 0;
+
+    for (int i = 0; i < nph; i++) {
+        if (ph[i].p_offset > size || ph[i].p_filesz > size - ph[i].p_offset) continue;
+        if (ph[i].p_type == PT_INTERP && ph[i].p_filesz > 0
+            && map[ph[i].p_offset + ph[i].p_filesz - 1] == '\0') {
+            (void)prefetch_file(job, (const char *)map + ph[i].p_offset);
+        } else if (ph[i].p_type == PT_DYNAMIC) {
+            dyn = (const Elf64_Dyn *)(map + ph[i].p_offset);
+            ndyn = ph[i].p_filesz / sizeof(Elf64_Dyn);
+        }
+    }
+
+    size_t strtab = (size_t)-1, strsz = 0, rpath = (size_t)-1, runpath = (size_t)-1;
+    for (size_t i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++) {
+        if (dyn[i].d_tag == DT_STRTAB) strtab = elf_offset(ph, nph, dyn[i].d_un.d_ptr);
+        else if (dyn[i].d_tag == DT_STRSZ) strsz = dyn[i].d_un.d_val;
+        else if (dyn[i].d_tag == DT_RPATH) rpath = dyn[i].d_un.d_val;
+        else if (dyn[i].d_tag == DT_RUNPATH) runpath = dyn[i].d_un.d_val;
+    }
+
+    if (strtab < size && strsz <= size - strtab && strsz > 0 && map[strtab + strsz - 1] == '\0') {
+        const char *str = (const char *)map + strtab;
+        const char *rp = rpath < strsz ? str + rpath : NULL;
+        const char *rup = runpath < strsz ? str + runpath : NULL;
+        for (size_t i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++) {
+            if (dyn[i].d_tag == DT_NEEDED && dyn[i].d_un.d_val < strsz) {
+                prefetch_lib(job, rp, rup, str + dyn[i].d_un.d_val);
+            }
+        }
+    }
+
+    munmap(map, size);
+    return 0;
+}
+
+// Resolve name through env (PATH) like execvp() does and prefetch what it
+// would load.
+static void prefetch_command(struct prefetch_job *job, const char *name, const char *env)
+{
+    char path[PATH_SIZE];
+
+    if (strchr(name, '/') != NULL) {
+        (void)prefetch_file(job, name);
+        return;
+    }
+
+    while (*env != '\0') {
+        const char *end = strchr(env, ':');
+        size_t dlen = end ? (size_t)(end - env) : strlen(env);
+
+        if (dlen > 0 && dlen + strlen(name) + 2 <= sizeof(path)) {
+            memcpy(path, env, dlen);
+            path[dlen] = '/';
+            memcpy(path + dlen + 1, name, strlen(name) + 1);
+            if (access(path, X_OK) == 0) {
+                (void)prefetch_file(job, path);
+                return;
+            }
+        }
+        if (end == NULL) break;
+        env = end + 1;
+    }
+}
+
+static void *prefetch_main(void *arg)
+{
+    static struct prefetch_req req;
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&prefetch_lock);
+        while (prefetch_count == 0) pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        req = prefetch_queue[prefetch_head];
+        prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE;
+        prefetch_count--;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        struct timespec a, b;
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        prefetch_cur.nfiles = 0;
+        prefetch_cur.bytes = 0;
+        prefetch_cur.lib_path = req.lib_path;
+        prefetch_command(&prefetch_cur, req.name, req.path);
+        clock_gettime(CLOCK_MONOTONIC, &b);
+
+        pthread_mutex_lock(&prefetch_lock);
+        prefetch_reqs++;
+        prefetch_files += (unsigned long long)prefetch_cur.nfiles;
+        prefetch_bytes += prefetch_cur.bytes;
+        prefetch_ns += elapsed_us(a, b) * 1000ULL;
+        pthread_mutex_unlock(&prefetch_lock);
+    }
+    return NULL;
+}
+
+// Queue the command of line (its first word, or the second after "cache").
+static void prefetch_request(const char *line)
+{
+    char name[PATH_SIZE];
+    size_t n = 0;
+
+    if (!prefetch_enabled()) return;
+
+    for (int word = 0; word < 2; word++) {
+        while (*line == ' ' || *line == '\t') line++;
+        n = 0;
+        while (line[n] != '\0' && line[n] != ' ' && line[n] != '\t' && line[n] != '\n') n++;
+        if (n != 5 || strncmp(line, "cache", 5) != 0) break;
+        line += n;
+    }
+    if (n == 0 || n >= sizeof(name)) return;
+    memcpy(name, line, n);
+    name[n] = '\0';
+
+    pthread_mutex_lock(&prefetch_lock);
+    if (!prefetch_started) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        prefetch_started = pthread_create(&prefetch_thread, &attr, prefetch_main, NULL) == 0 ? 1 : -1;
+        pthread_attr_destroy(&attr);
+    }
+    int last = (prefetch_head + prefetch_count + PREFETCH_QUEUE - 1) % PREFETCH_QUEUE;
+    if (prefetch_started > 0 && (prefetch_count == 0 || strcmp(prefetch_queue[last].name, name) != 0)) {
+        if (prefetch_count == PREFETCH_QUEUE) {   // full: drop the oldest
+            prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE;
+            prefetch_count--;
+        }
+        struct prefetch_req *req = &prefetch_queue[(prefetch_head + prefetch_count) % PREFETCH_QUEUE];
+        const char *path = env_get("PATH");
+        const char *lib_path = env_get("LD_LIBRARY_PATH");
+        size_t pos = 0;
+
+        memcpy(req->name, name, n + 1);
+        req->path[0] = '\0';
+        append_str(req->path, &pos, sizeof(req->path), path ? path : "/usr/local/bin:/usr/bin:/bin");
+        pos = 0;
+        req->lib_path[0] = '\0';
+        append_str(req->lib_path, &pos, sizeof(req->lib_path), lib_path ? lib_path : "");
+        prefetch_count++;
+        pthread_cond_signal(&prefetch_cond);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+// "prefetch <requests> <files> <bytes> <ns>", appended to the phases file.
+static void prefetch_dump(void)
+{
+    const char *file = getenv("ENSEASH_PHASES");
+    char out[128];
+    size_t pos = 0;
+
+    if (!phases_on || file == NULL || prefetch_started <= 0) return;
+    int fd = open(file, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) return;
+
+    pthread_mutex_lock(&prefetch_lock);
+    out[0] = '\0';
+    append_str(out, &pos, sizeof(out), "prefetch ");
+    append_num(out, &pos, sizeof(out), prefetch_reqs);
+    append_str(out, &pos, sizeof(out), " ");
+    append_num(out, &pos, sizeof(out), prefetch_files);
+    append_str(out, &pos, sizeof(out), " ");
+    append_num(out, &pos, sizeof(out), prefetch_bytes);
+    append_str(out, &pos, sizeof(out), " ");
+    append_num(out, &pos, sizeof(out), prefetch_ns);
+    append_str(out, &pos, sizeof(out), "\n");
+    pthread_mutex_unlock(&prefetch_lock);
+
+    safe_write(fd, out);
+    close(fd);
+}
+
+// ---------------------------------------------------------------------------
+// Line input
+//
+// On a terminal the line is edited in raw mode (cursor keys, Tab completion).
+// Otherwise input is read through a buffer and handed out one line at a time,
+// so piped scripts with several lines per read() work too.
+// ---------------------------------------------------------------------------
+
+static const char *builtin_names[] = { "exit", "cache", "history", "stats", "export", "unset", "watch-run" };
+
+static struct termios saved_termios;
+static int raw_enabled;
+
+static void raw_disable(void)
+{
+    if (raw_enabled) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &saved_termios);
+        raw_enabled = 0;
+    }
+}
+
+static int raw_enable(void)
+{
+    struct termios t;
+
+    if (tcgetattr(STDIN_FILENO, &saved_termios) < 0) return -1;
+    t = saved_termios;
+    // no ISIG: Ctrl+C is read as a key, so the shell never dies in raw mode
+    t.c_lflag &= ~(tcflag_t)(ICANON | ECHO | IEXTEN | ISIG);
+    t.c_iflag &= ~(tcflag_t)(IXON | ICRNL);
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &t) < 0) return -1;
+    raw_enabled = 1;
+    return 0;
+}
+
+// Returns 1 with a NUL-terminated line (no '\n'), 0 on EOF, -1 on error.
+static int read_line_batch(char *line, size_t size)
+{
+    static char in_buf[IO_CHUNK];
+    static size_t in_pos, in_len;
+    size_t n = 0;
+
+    for (;;) {
+        if (in_pos == in_len) {
+            ssize_t r = read(STDIN_FILENO, in_buf, sizeof(in_buf));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) {
+                line[n] = '\0';
+                return n > 0 ? 1 : (int)r;
+            }
+            in_pos = 0;
+            in_len = (size_t)r;
+        }
+
+        char c = in_buf[in_pos++];
+        if (c == '\n') {
+            line[n] = '\0';
+            // lookahead: warm up the next command while this one runs
+            if (in_pos < in_len && prefetch_enabled()) {
+                char next[BUFFER_SIZE];
+                size_t k = 0;
+                while (in_pos + k < in_len && k + 1 < sizeof(next) && in_buf[in_pos + k] != '\n') {
+                    next[k] = in_buf[in_pos + k];
+                    k++;
+                }
+                next[k] = '\0';
+                prefetch_request(next);
+            }
+            return 1;
+        }
+        if (n + 1 < size) line[n++] = c;   // too long: the tail is dropped
+    }
+}
+
+// Prefix trie of PATH executables. Nodes live in one array, linked by index
+// (first child / next sibling, siblings sorted). count = number of PATH
+// directories providing the name ending at that node.
+struct trie_node {
+    int child;
+    int sibling;
+    int count;
+    char c;
+};
+
+static struct trie_node *trie;
+static int trie_len, trie_cap;
+
+static int trie_new_node(char c)
+{
+    if (trie_len == trie_cap) {
+        int cap = trie_cap ? trie_cap * 2 : 1024;
+        struct trie_node *t = realloc(trie, (size_t)cap * sizeof(*t));
+        if (t == NULL) return -1;
+        trie = t;
+        trie_cap = cap;
+    }
+    trie[trie_len].child = -1;
+    trie[trie_len].sibling = -1;
+    trie[trie_len].count = 0;
+    trie[trie_len].c = c;
+    return trie_len++;
+}
+
+static void trie_add(const char *name, int delta)
+{
+    if (trie_len == 0 && trie_new_node('\0') < 0) return;
+
+    int node = 0;
+    for (const char *p = name; *p != '\0'; p++) {
+        int *link = &trie[node].child;
+        while (*link >= 0 && trie[*link].c < *p) link = &trie[*link].sibling;
+
+        if (*link < 0 || trie[*link].c != *p) {
+            if (delta < 0) return;   // not present
+            int n = trie_new_node(*p);
+            if (n < 0) return;
+            // trie may have moved: recompute the link
+            link = &trie[node].child;
+            while (*link >= 0 && trie[*link].c < *p) link = &trie[*link].sibling;
+            trie[n].sibling = *link;
+            *link = n;
+        }
+        node = *link;
+    }
+    trie[node].count += delta;
+}
+
+static int trie_collect(int node, char *name, size_t len, struct arg_list *out)
+{
+    if (trie[node].count > 0 && arg_push(out, name) < 0) return -1;
+    if (len + 2 >= BUFFER_SIZE) return 0;
+
+    for (int c = trie[node].child; c >= 0; c = trie[c].sibling) {
+        name[len] = trie[c].c;
+        name[len + 1] = '\0';
+        if (trie_collect(c, name, len + 1, out) < 0) return -1;
+    }
+    name[len] = '\0';
+    return 0;
+}
+
+// Names in the trie starting with prefix, in sorted order.
+static int trie_complete(const char *prefix, struct arg_list *out)
+{
+    char name[BUFFER_SIZE];
+    size_t len = 0;
+    int node = 0;
+
+    if (trie_len == 0) return 0;
+    for (const char *p = prefix; *p != '\0'; p++) {
+        int c = trie[node].child;
+        while (c >= 0 && trie[c].c != *p) c = trie[c].sibling;
+        if (c < 0) return 0;
+        node = c;
+        if (len + 1 < sizeof(name)) name[len++] = *p;
+    }
+    name[len] = '\0';
+    return trie_collect(node, name, len, out);
+}
+
+// One PATH directory: its executables as they were at mtime.
+struct path_dir {
+    char path[PATH_SIZE];
+    int valid;
+    int racy;
+    struct timespec mtime;
+    struct dir_listing exes;
+};
+
+static struct path_dir path_dirs[MAX_PATH_DIRS];
+static int n_path_dirs;
+static char path_env[IO_CHUNK];
+static int builtins_added;
+
+static void path_dir_forget(struct path_dir *pd)
+{
+    for (size_t i = 0; i < pd->exes.count; i++) {
+        trie_add(pd->exes.names + pd->exes.offsets[i], -1);
+    }
+    dir_listing_clear(&pd->exes);
+    pd->valid = 0;
+}
+
+static void path_dir_scan(struct path_dir *pd, const struct stat *st)
+{
+    struct dir_listing all;
+    struct timespec now;
+
+    path_dir_forget(pd);
+
+    memset(&all, 0, sizeof(all));
+    int dfd = open(pd->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) return;
+    if (dir_listing_read(&all, pd->path) < 0) {
+        close(dfd);
+        dir_listing_clear(&all);
+        return;
+    }
+
+    for (size_t i = 0; i < all.count; i++) {
+        const char *name = all.names + all.offsets[i];
+        unsigned char type = all.types[i];
+        struct stat est;
+
+        if (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN) continue;
+        if (fstatat(dfd, name, &est, 0) < 0) continue;
+        if (!S_ISREG(est.st_mode) || (est.st_mode & 0111) == 0) continue;
+        if (dir_listing_add(&pd->exes, name, type) < 0) break;
+        trie_add(name, 1);
+    }
+
+    close(dfd);
+    dir_listing_clear(&all);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    pd->mtime = st->st_mtim;
+    pd->racy = st->st_mtim.tv_sec >= now.tv_sec - 1;
+    pd->valid = 1;
+}
+
+// Bring the trie up to date: only directories whose mtime moved are rescanned.
+static void path_refresh(void)
+{
+    const char *path = getenv("PATH");
+    if (path == NULL) path = "";
+
+    if (!builtins_added) {
+        for (size_t i = 0; i < sizeof(builtin_names) / sizeof(builtin_names[0]); i++) {
+            trie_add(builtin_names[i], 1);
+        }
+        builtins_added = 1;
+    }
+
+    if (strcmp(path, path_env) != 0) {
+        for (int i = 0; i < n_path_dirs; i++) path_dir_forget(&path_dirs[i]);
+        n_path_dirs = 0;
+
+        size_t pos = 0;
+        path_env[0] = '\0';
+        append_str(path_env, &pos, sizeof(path_env), path);
+
+        const char *p = path;
+        while (n_path_dirs < MAX_PATH_DIRS) {
+            const char *end = strchr(p, ':');
+            size_t len = end ? (size_t)(end - p) : strlen(p);
+            struct path_dir *pd = &path_dirs[n_path_dirs];
+
+            if (len > 0 && len < sizeof(pd->path)) {
+                memset(pd, 0, sizeof(*pd));
+                memcpy(pd->path, p, len);
+                pd->path[len] = '\0';
+                n_path_dirs++;
+            }
+            if (end == NULL) break;
+            p = end + 1;
+        }
+    }
+
+    for (int i = 0; i < n_path_dirs; i++) {
+        struct path_dir *pd = &path_dirs[i];
+        struct stat st;
+
+        if (stat(pd->path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+            if (pd->valid) path_dir_forget(pd);
+            continue;
+        }
+        if (pd->valid && !pd->racy && pd->mtime.tv_sec == st.st_mtim.tv_sec
+            && pd->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            continue;
+        }
+        path_dir_scan(pd, &st);
+    }
+}
+
+// File names in the directory part of word starting with its last component.
+// Directories get a trailing '/'.
+static int file_complete(const char *word, struct arg_list *out)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(word, '/');
+    const char *base = slash ? slash + 1 : word;
+    size_t dlen = slash ? (size_t)(slash - word) + 1 : 0;
+    size_t blen = strlen(base);
+
+    if (dlen + 1 >= sizeof(dir)) return 0;
+    memcpy(dir, word, dlen);
+    dir[dlen] = '\0';
+
+    struct dir_listing *d = dir_list(dlen ? dir : ".");
+    if (d == NULL) return 0;
+
+    int r = 0;
+    for (size_t i = 0; i < d->count && r == 0; i++) {
+        const char *name = d->names + d->offsets[i];
+        char cand[BUFFER_SIZE];
+        size_t nlen = strlen(name);
+        unsigned char type = d->types[i];
+
+        if (name[0] == '.' && base[0] != '.') continue;
+        if (strncmp(name, base, blen) != 0) continue;
+        if (nlen + 2 > sizeof(cand)) continue;
+
+        if (type == DT_LNK || type == DT_UNKNOWN) {
+            struct stat st;
+            if (dlen + nlen < sizeof(dir)) {
+                memcpy(dir + dlen, name, nlen + 1);
+                if (stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) type = DT_DIR;
+                dir[dlen] = '\0';
+            }
+        }
+
+        memcpy(cand, name, nlen + 1);
+        if (type == DT_DIR) {
+            cand[nlen] = '/';
+            cand[nlen + 1] = '\0';
+        }
+        r = arg_push(out, cand);
+    }
+
+    dir_release(d);
+    if (r == 0 && out->argc > 1) {
+        qsort(out->v, (size_t)out->argc, sizeof(char *), cmp_str);
+    }
+    return r;
+}
+
+static void redraw_line(const char *prompt, const char *line, size_t len, size_t cur)
+{
+    char out[PROMPT_SIZE + BUFFER_SIZE + 32];
+    size_t pos = 0;
+
+    append_str(out, &pos, sizeof(out), "\r");
+    append_str(out, &pos, sizeof(out), prompt);
+    if (pos + len + 1 < sizeof(out)) {
+        memcpy(out + pos, line, len);
+        pos += len;
+        out[pos] = '\0';
+    }
+    append_str(out, &pos, sizeof(out), "\x1b[K");
+    if (cur < len) {
+        append_str(out, &pos, sizeof(out), "\x1b[");
+        append_num(out, &pos, sizeof(out), (unsigned long long)(len - cur));
+        append_str(out, &pos, sizeof(out), "D");
+    }
+    (void)write(STDOUT_FILENO, out, pos);
+}
+
+static void insert_text(char *line, size_t size, size_t *len, size_t *cur, const char *text, size_t n)
+{
+    if (*len + n + 1 > size) n = size - 1 - *len;
+    memmove(line + *cur + n, line + *cur, *len - *cur);
+    memcpy(line + *cur, text, n);
+    *len += n;
+    *cur += n;
+    line[*len] = '\0';
+}
+
+static void complete_word(const char *prompt, char *line, size_t size, size_t *len, size_t *cur)
+{
+    struct arg_list cands = { 0 };
+    char word[BUFFER_SIZE];
+    size_t start = *cur;
+
+    while (start > 0 && line[start - 1] != ' ' && line[start - 1] != '\t') start--;
+    memcpy(word, line + start, *cur - start);
+    word[*cur - start] = '\0';
+
+    // command position: first word, or the word after a "cache" prefix
+    size_t w = 0;
+    while (w < start && (line[w] == ' ' || line[w] == '\t')) w++;
+    int is_cmd = (w == start);
+    if (!is_cmd && strncmp(line + w, "cache", 5) == 0) {
+        size_t k = w + 5;
+        while (k < start && (line[k] == ' ' || line[k] == '\t')) k++;
+        is_cmd = (k == start && k > w + 5);
+    }
+
+    size_t skip;
+    if (is_cmd && strchr(word, '/') == NULL) {
+        path_refresh();
+        trie_complete(word, &cands);
+        skip = strlen(word);
+    } else {
+        file_complete(word, &cands);
+        const char *slash = strrchr(word, '/');
+        skip = strlen(slash ? slash + 1 : word);
+    }
+
+    if (cands.argc == 1) {
+        const char *c = cands.v[0];
+        size_t clen = strlen(c);
+        insert_text(line, size, len, cur, c + skip, clen - skip);
+        if (clen == 0 || c[clen - 1] != '/') insert_text(line, size, len, cur, " ", 1);
+        if (is_cmd) prefetch_request(line + start);
+    } else if (cands.argc > 1) {
+        // longest common prefix of the (sorted) candidates = first vs last
+        const char *a = cands.v[0], *b = cands.v[cands.argc - 1];
+        size_t lcp = 0;
+        while (a[lcp] != '\0' && a[lcp] == b[lcp]) lcp++;
+
+        if (lcp > skip) {
+            insert_text(line, size, len, cur, a + skip, lcp - skip);
+        } else {
+            safe_write(STDOUT_FILENO, "\r\n");
+            for (int i = 0; i < cands.argc && i < MAX_COMPLETIONS; i++) {
+                safe_write(STDOUT_FILENO, cands.v[i]);
+                safe_write(STDOUT_FILENO, "  ");
+            }
+            if (cands.argc > MAX_COMPLETIONS) safe_write(STDOUT_FILENO, "...");
+            safe_write(STDOUT_FILENO, "\r\n");
+        }
+    }
+
+    arg_free(&cands);
+    redraw_line(prompt, line, *len, *cur);
+}
+
+static void set_line(char *line, size_t size, size_t *len, size_t *cur, const char *text)
+{
+    size_t pos = 0;
+    line[0] = '\0';
+    append_str(line, &pos, size, text);
+    *len = *cur = pos;
+}
+
+// Latest entry before 'from' containing query, or -1.
+static long hist_search(const char *query, size_t from)
+{
+    while (from-- > 0) {
+        if (strstr(hist_cmd(hist_get(from)), query) != NULL) return (long)from;
+    }
+    return -1;
+}
+
+// Ctrl+R incremental search. Returns 1 if Enter was pressed on a match,
+// 0 to go back to editing (with the match, or the original line on Ctrl+G).
+static int reverse_search(const char *prompt, char *line, size_t size, size_t *len, size_t *cur)
+{
+    char query[BUFFER_SIZE];
+    char saved[BUFFER_SIZE];
+    size_t qlen = 0;
+    long match = -1;
+
+    query[0] = '\0';
+    memcpy(saved, line, *len + 1);
+    hist_sync();
+
+    for (;;) {
+        char out[PROMPT_SIZE + 2 * BUFFER_SIZE];
+        size_t pos = 0;
+        append_str(out, &pos, sizeof(out), "\r(reverse-i-search)`");
+        append_str(out, &pos, sizeof(out), query);
+        append_str(out, &pos, sizeof(out), "': ");
+        if (match >= 0) append_str(out, &pos, sizeof(out), hist_cmd(hist_get((size_t)match)));
+        append_str(out, &pos, sizeof(out), "\x1b[K");
+        (void)write(STDOUT_FILENO, out, pos);
+
+        char c;
+        ssize_t r = read(STDIN_FILENO, &c, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) c = 7;
+
+        if (c == 18) {              // Ctrl+R again: older match
+            long older = hist_search(query, match >= 0 ? (size_t)match : hist_count);
+            if (older >= 0) match = older;
+        } else if (c == 127 || c == 8) {
+            if (qlen > 0) query[--qlen] = '\0';
+            match = qlen ? hist_search(query, hist_count) : -1;
+        } else if (c == 7 || c == 27 || c == 3) {   // Ctrl+G / Esc / Ctrl+C: cancel
+            set_line(line, size, len, cur, saved);
+            redraw_line(prompt, line, *len, *cur);
+            return 0;
+        } else if ((unsigned char)c >= 32 && qlen + 1 < sizeof(query)) {
+            query[qlen++] = c;
+            query[qlen] = '\0';
+            long m = hist_search(query, match >= 0 ? (size_t)match + 1 : hist_count);
+            if (m >= 0) match = m;
+        } else {
+            if (match >= 0) set_line(line, size, len, cur, hist_cmd(hist_get((size_t)match)));
+            redraw_line(prompt, line, *len, *cur);
+            return (c == '\r' || c == '\n') && match >= 0;
+        }
+    }
+}
+
+// Raw-mode editor. Same return convention as read_line_batch.
+static int read_line_tty(const char *prompt, char *line, size_t size)
+{
+    size_t len = 0, cur = 0;
+    char draft[BUFFER_SIZE];
+
+    line[0] = '\0';
+    if (raw_enable() < 0) return read_line_batch(line, size);
+
+    hist_sync();
+    size_t nav = hist_count;   // == hist_count while editing the draft
+
+    for (;;) {
+        char c;
+        ssize_t r = read(STDIN_FILENO, &c, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            raw_disable();
+            return len > 0 ? 1 : (int)r;
+        }
+
+        if (c == '\r' || c == '\n') {
+            safe_write(STDOUT_FILENO, "\r\n");
+            raw_disable();
+            return 1;
+        }
+
+        switch (c) {
+        case 3:     // Ctrl+C: drop the line, fresh prompt
+            safe_write(STDOUT_FILENO, "^C\r\n");
+            raw_disable();
+            line[0] = '\0';
+            return 1;
+        case 4:     // Ctrl+D: EOF on an empty line, delete otherwise
+            if (len == 0) {
+                raw_disable();
+                return 0;
+            }
+            if (cur < len) {
+                memmove(line + cur, line + cur + 1, len - cur);
+                len--;
+            }
+            break;
+        case 127:   // Backspace
+        case 8:
+            if (cur > 0) {
+                memmove(line + cur - 1, line + cur, len - cur + 1);
+                cur--;
+                len--;
+            }
+            break;
+        case 1:     // Ctrl+A
+            cur = 0;
+            break;
+        case 5:     // Ctrl+E
+            cur = len;
+            break;
+        case 21:    // Ctrl+U
+            memmove(line, line + cur, len - cur + 1);
+            len -= cur;
+            cur = 0;
+            break;
+        case 11:    // Ctrl+K
+            len = cur;
+            line[len] = '\0';
+            break;
+        case '\t':
+            complete_word(prompt, line, size, &len, &cur);
+            continue;
+        case 18:    // Ctrl+R
+            if (hist_fd >= 0 && reverse_search(prompt, line, size, &len, &cur)) {
+                safe_write(STDOUT_FILENO, "\r\n");
+                raw_disable();
+                return 1;
+            }
+            continue;
+        case 27: {  // escape sequences: arrows, Home/End, Delete
+            char seq[3];
+            if (read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1) break;
+            if (seq[0] != '[' && seq[0] != 'O') break;
+            if (seq[1] == 'A' && nav > 0) {             // Up: older entry
+                if (nav == hist_count) memcpy(draft, line, len + 1);
+                nav--;
+                set_line(line, size, &len, &cur, hist_cmd(hist_get(nav)));
+            } else if (seq[1] == 'B' && nav < hist_count) {   // Down: newer entry
+                nav++;
+                set_line(line, size, &len, &cur, nav == hist_count ? draft : hist_cmd(hist_get(nav)));
+            } else if (seq[1] == 'C' && cur < len) {
+                cur++;
+            } else if (seq[1] == 'D' && cur > 0) {
+                cur--;
+            } else if (seq[1] == 'H') {
+                cur = 0;
+            } else if (seq[1] == 'F') {
+                cur = len;
+            } else if (seq[1] == '3' && read(STDIN_FILENO, &seq[2], 1) == 1 && seq[2] == '~' && cur < len) {
+                memmove(line + cur, line + cur + 1, len - cur);
+                len--;
+            }
+            break;
+        }
+        default:
+            if ((unsigned char)c >= 32) insert_text(line, size, &len, &cur, &c, 1);
+            // typing the space that ends the command word completes it too
+            if (c == ' ' && cur == len && strchr(line, ' ') == line + len - 1 && len > 1) {
+                prefetch_request(line);
+            }
+            break;
+        }
+
+        redraw_line(prompt, line, len, cur);
+    }
+}
+
+static int read_line(const char *prompt, char *line, size_t size)
+{
+    if (isatty(STDIN_FILENO)) return read_line_tty(prompt, line, size);
+    return read_line_batch(line, size);
+}
+
+static int repl(void)
+{
+    char buffer[BUFFER_SIZE];
+    char prompt[PROMPT_SIZE];
+
+    int has_last = 0;
+    int last_status = 0;
+    unsigned long long last_ms = 0;
+    int last_cache = CACHE_NONE;
+    unsigned long long last_saved_ms = 0;
+
+    safe_write(STDOUT_FILENO, WELCOME_MESSAGE);
+    hist_open();
+    phase_start();
+    var_init();
+    signal(SIGPIPE, SIG_IGN);   // a "<z" relay may outlive its reader
+    if (tree_enabled()) (void)prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+
+    while (1) {
+        build_prompt(prompt, sizeof(prompt), has_last, last_status, last_ms,
+                     last_cache, last_saved_ms);
+        safe_write(STDOUT_FILENO, prompt);
+        phase_lap(PH_PROMPT);
+
+        memset(buffer, 0, sizeof(buffer));
+        int n = read_line(prompt, buffer, sizeof(buffer));
+        phase_lap(PH_INPUT);
+
+        if (n <= 0) {
+            safe_write(STDOUT_FILENO, BYE_MESSAGE);
+            break;
+        }
+
+        strip_eol(buffer);
+        trim_spaces(buffer);
+
+        if (buffer[0] == '\0') continue;
+
+        int ex = hist_expand(buffer, sizeof(buffer));
+        if (ex < 0) {
+            safe_write(STDERR_FILENO, "Error: event not found\n");
+            continue;
+        }
+        if (ex > 0) {
+            safe_write(STDOUT_FILENO, buffer);
+            safe_write(STDOUT_FILENO, "\n");
+        }
+
+        if (strcmp(buffer, "exit") == 0) {
+            safe_write(STDOUT_FILENO, BYE_MESSAGE);
+            break;
+        }
+
+        char line[BUFFER_SIZE];
+        memcpy(line, buffer, sizeof(line));   // parse_args cuts buffer up
+
+        // history keeps the line as typed, before variable expansion
+        if (var_expand(buffer, sizeof(buffer), last_status) < 0) {
+            safe_write(STDERR_FILENO, "Error: line too long after expansion\n");
+            continue;
+        }
+
+        char *argv[MAX_ARGS];
+        int argc = parse_args(buffer, argv, MAX_ARGS);
+        if (argc == 0) continue;
+
+        struct arg_list args = { 0 };
+        if (expand_globs(argv, argc, &args) < 0) {
+            safe_write(STDERR_FILENO, "Error: glob expansion failed\n");
+            arg_free(&args);
+            continue;
+        }
+        phase_lap(PH_PARSE);
+
+        // leading NAME=value words: shell variables alone, the command's
+        // environment otherwise
+        int nassign = var_assignments(args.v, args.argc);
+        if (nassign == args.argc) {
+            for (int i = 0; i < nassign; i++) {
+                char *eq = strchr(args.v[i], '=');
+                *eq = '\0';
+                var_set(args.v[i], eq + 1, 0);
+            }
+            arg_free(&args);
+            hist_add(line, 0, 0);
+            continue;
+        }
+        char **cmdv = args.v + nassign;
+        int cmdc = args.argc - nassign;
+        char **override = nassign > 0 && env_vec != NULL ? env_override(args.v, nassign) : NULL;
+
+        int status;
+        unsigned long long ms;
+        int cache = CACHE_NONE;
+        unsigned long long saved_ms = 0;
+        int r;
+
+        struct timespec t0, t1;
+        if (tree_enabled()) tree_collect_late();
+        unsigned long long late0 = tree_late_cpu;
+        unsigned long long cpu0 = children_cpu_us();
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        if (strcmp(cmdv[0], "cache") == 0) {
+            if (cmdc < 2) {
+                safe_write(STDERR_FILENO, "Error: usage: cache cmd [args...]\n");
+                r = -1;
+            } else {
+                r = cache_run(cmdv + 1, cmdc - 1, &status, &ms, &cache, &saved_ms);
+            }
+        } else if (strcmp(cmdv[0], "history") == 0) {
+            hist_builtin(cmdv, cmdc);
+            r = 1;
+        } else if (strcmp(cmdv[0], "stats") == 0) {
+            stats_builtin(cmdv, cmdc);
+            r = 1;
+        } else if (strcmp(cmdv[0], "export") == 0) {
+            export_builtin(cmdv, cmdc);
+            r = 1;
+        } else if (strcmp(cmdv[0], "unset") == 0) {
+            unset_builtin(cmdv, cmdc);
+            r = 1;
+        } else if (strcmp(cmdv[0], "watch-run") == 0) {
+            watch_builtin(cmdv, cmdc);
+            r = 1;
+        } else {
+            r = run_command(cmdv, cmdc, &status, &ms);
+        }
+        if (override != NULL) env_restore(override);
+        if (r > 0) {   // builtins: kept in history, but no status or stats row
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            arg_free(&args);
+            hist_add(line, 0, elapsed_ms(t0, t1));
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (r == 0) {
+            const char *name = strcmp(cmdv[0], "cache") == 0 ? cmdv[1] : cmdv[0];
+            // late descendants reaped during the command are not its CPU
+            stats_record(name, elapsed_us(t0, t1), children_cpu_us() - cpu0 - (tree_late_cpu - late0));
+        }
+        arg_free(&args);
+
+        if (r == 0) {
+            hist_add(line, status, ms);
+            last_status = status;
+            last_ms = ms;
+            last_cache = cache;
+            last_saved_ms = saved_ms;
+            has_last = 1;
+            phase_cmds++;
+        }
+        phase_lap(PH_OTHER);
+    }
+
+    phase_dump();
+    prefetch_dump();
+
+    const char *stats_file = getenv("ENSEASH_STATS_FILE");
+    if (stats_file != NULL && n_stats > 0) stats_dump(stats_file);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 3 && strcmp(argv[1], "--serve") == 0) {
+        int jobs = SERVE_DEFAULT_JOBS;
+        if (argc >= 5 && strcmp(argv[3], "--jobs") == 0) jobs = (int)parse_num(argv[4], SERVE_DEFAULT_JOBS);
+        if (jobs < 1) jobs = 1;
+        return serve(argv[2], jobs);
+    }
+    if (argc >= 2) {
+        safe_write(STDERR_FILENO, "Usage: enseash [--serve SOCKET [--jobs N]]\n");
+        return EXIT_FAILURE;
+    }
+    return repl();
+}